@@ -2,6 +2,49 @@
 #ifndef __LORA_H__
 #define __LORA_H__
 
+#include <stdint.h>
+#include "freertos/FreeRTOS.h"
+#include "freertos/task.h"
+
+/*
+ * SPI traffic counters
+ */
+typedef struct
+{
+   uint32_t transactions;
+   uint32_t bytes;
+} lora_spi_stats_t;
+
+/*
+ * Complete modem configuration, applied with lora_apply_profile()
+ */
+typedef struct
+{
+   long frequency;         // Carrier frequency in Hz
+   long bandwidth;         // Bandwidth in Hz
+   int spreading_factor;   // 6-12
+   int coding_rate;        // 5-8, denominator of the coding rate 4/x
+   long preamble_length;   // Preamble length in symbols
+   int crc;                // Non-zero to append/verify packet CRC
+   int implicit_header;    // Packet size in implicit header mode, zero for explicit header mode
+} lora_modem_profile_t;
+
+/*
+ * Called by lora_tx_poll() once an asynchronous transmission ended.
+ * success is zero if TxDone was not seen before the deadline.
+ */
+typedef void (*lora_tx_done_cb_t)(int success, void *arg);
+
+/*
+ * Link quality of the last received packet, see lora_read_packet_meta()
+ */
+typedef struct
+{
+   int16_t rssi;       // Packet RSSI in dBm
+   int8_t snr;         // Packet SNR in quarter dB
+   int32_t freq_error; // Carrier frequency error in Hz
+} lora_packet_meta_t;
+
 void lora_reset(void);
 void lora_explicit_header_mode(void);
 void lora_implicit_header_mode(int size);
@@ -23,8 +66,28 @@ int lora_receive_packet(uint8_t *buf, int size);
 int lora_received(void);
 int lora_packet_rssi(void);
 float lora_packet_snr(void);
+long lora_packet_freq_error(void);
+void lora_read_packet_meta(lora_packet_meta_t *meta);
 void lora_close(void);
 int lora_initialized(void);
 void lora_dump_registers(void);
+int lora_enable_rx_interrupt(TaskHandle_t task);
+void lora_disable_rx_interrupt(void);
+int64_t lora_last_irq_time(void);
+void lora_write_fifo(const uint8_t *buf, int size);
+void lora_read_fifo(uint8_t *buf, int size);
+void lora_get_spi_stats(lora_spi_stats_t *stats);
+void lora_reset_spi_stats(void);
+void lora_benchmark_fifo(int size, int iterations);
+void lora_apply_profile(const lora_modem_profile_t *profile);
+void lora_get_profile(lora_modem_profile_t *profile);
+int lora_send_packet_async(const uint8_t *buf, int size, lora_tx_done_cb_t done, void *arg);
+int lora_tx_busy(void);
+void lora_tx_poll(void);
+void lora_cad_start(void);
+int lora_cad_poll(void);
+void lora_cad_stop(void);
+int lora_rx_in_progress(void);
+long lora_time_on_air_us(const lora_modem_profile_t *profile, int size);
 
 #endif
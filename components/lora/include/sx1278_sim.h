@@ -0,0 +1,24 @@
+#ifndef __LORA_SIM_H__
+#define __LORA_SIM_H__
+
+#include <stdint.h>
+
+/*
+ * Counters of the simulated air interface (linux target only)
+ */
+typedef struct
+{
+   uint32_t generated;  // Packets put on the air
+   uint32_t duplicates; // Generated packets which repeat an earlier one
+   uint32_t overruns;   // Packets lost because the receiver did not empty the FIFO
+   uint32_t received;   // Packets read by the receiver
+   uint32_t deaf;       // Packets lost because the receiver was transmitting
+   uint32_t sent;       // Packets transmitted by the receiver
+   uint32_t missed;     // Packets sent on a spreading factor the receiver did not switch to in time
+} lora_sim_stats_t;
+
+int64_t lora_sim_time(void);
+int64_t lora_sim_sent_time(uint32_t node_id, uint32_t message_id);
+void lora_sim_get_stats(lora_sim_stats_t *stats);
+
+#endif
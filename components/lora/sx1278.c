@@ -1,4 +1,4 @@
-
+#include "sx1278.h"
 #include "freertos/FreeRTOS.h"
 #include "freertos/task.h"
 #include "esp_system.h"
@@ -8,6 +8,8 @@
 #include "rom/gpio.h"
 #include <string.h>
 #include "esp_log.h"
+#include "esp_timer.h"
+#include "esp_attr.h"
 
 /*
  * Register definitions
@@ -25,6 +27,7 @@
 #define REG_FIFO_RX_CURRENT_ADDR 0x10
 #define REG_IRQ_FLAGS 0x12
 #define REG_RX_NB_BYTES 0x13
+#define REG_MODEM_STAT 0x18
 #define REG_PKT_SNR_VALUE 0x19
 #define REG_PKT_RSSI_VALUE 0x1a
 #define REG_MODEM_CONFIG_1 0x1d
@@ -33,6 +36,7 @@
 #define REG_PREAMBLE_LSB 0x21
 #define REG_PAYLOAD_LENGTH 0x22
 #define REG_MODEM_CONFIG_3 0x26
+#define REG_FEI_MSB 0x28
 #define REG_RSSI_WIDEBAND 0x2c
 #define REG_DETECTION_OPTIMIZE 0x31
 #define REG_DETECTION_THRESHOLD 0x37
@@ -49,6 +53,7 @@
 #define MODE_TX 0x03
 #define MODE_RX_CONTINUOUS 0x05
 #define MODE_RX_SINGLE 0x06
+#define MODE_CAD 0x07
 
 /*
  * PA configuration
@@ -58,39 +63,148 @@
 /*
  * IRQ masks
  */
+#define IRQ_CAD_DETECTED_MASK 0x01
+#define IRQ_CAD_DONE_MASK 0x04
 #define IRQ_TX_DONE_MASK 0x08
 #define IRQ_PAYLOAD_CRC_ERROR_MASK 0x20
 #define IRQ_RX_DONE_MASK 0x40
 
+/*
+ * DIO0 mapping (bits 7-6 of REG_DIO_MAPPING_1)
+ */
+#define DIO0_MAPPING_MASK 0xc0
+#define DIO0_MAPPING_RX_DONE 0x00
+#define DIO0_MAPPING_TX_DONE 0x40
+#define DIO0_MAPPING_CAD_DONE 0x80
+
+/*
+ * REG_MODEM_STAT bits, set from the preamble until the packet ends
+ */
+#define MODEM_STAT_SIGNAL_SYNCHRONIZED 0x02
+#define MODEM_STAT_HEADER_VALID 0x08
+
 #define PA_OUTPUT_RFO_PIN 0
 #define PA_OUTPUT_PA_BOOST_PIN 1
 
 #define TIMEOUT_RESET 100
 
+/*
+ * Size of the radio FIFO
+ */
+#define LORA_FIFO_SIZE 256
+
+/*
+ * Transactions up to this size go through the transaction's own
+ * tx_data/rx_data words and never touch DMA
+ */
+#define LORA_SPI_INLINE_SIZE 4
+
+/*
+ * Longer transactions are padded to whole words, with DMA the master
+ * driver bounces any receive buffer or length which is not word aligned
+ * through a heap allocation
+ */
+#define LORA_SPI_ALIGN(len) (((len) + 3) & ~3)
+
 static spi_device_handle_t __spi;
 
 static int __implicit;
 static long __frequency;
 
+/*
+ * Shadow copies of the modem configuration registers.
+ * Setters update the shadow and write it through,
+ * so they never have to read the register back over SPI.
+ */
+static uint8_t __modem_config_1;
+static uint8_t __modem_config_2;
+static uint8_t __modem_config_3;
+static uint16_t __preamble_length;
+static uint8_t __payload_length;
+
+/*
+ * Bandwidths selected by the REG_MODEM_CONFIG_1 bandwidth field
+ */
+static const long __bandwidths[] = {7800, 10400, 15600, 20800, 31250, 41700, 62500, 125000, 250000, 500000};
+
+static lora_spi_stats_t __spi_stats;
+
+/*
+ * DMA capable buffers for burst FIFO transfers, one byte for the
+ * register address followed by the whole FIFO, padded to whole words
+ */
+DMA_ATTR static uint8_t __fifo_out[LORA_SPI_ALIGN(LORA_FIFO_SIZE + 1)];
+DMA_ATTR static uint8_t __fifo_in[LORA_SPI_ALIGN(LORA_FIFO_SIZE + 1)];
+
+static TaskHandle_t __irq_task;
+
+/*
+ * Time of the last RxDone interrupt, set until lora_last_irq_time()
+ * takes it. The lock keeps the 64 bit time from tearing
+ */
+static int64_t __irq_time;
+static int __irq_time_valid;
+static portMUX_TYPE __irq_lock = portMUX_INITIALIZER_UNLOCKED;
+
+/*
+ * Event currently routed to DIO0
+ */
+static volatile uint8_t __dio0_mapping = DIO0_MAPPING_RX_DONE;
+
+/*
+ * Asynchronous transmission in progress, only touched by the task which owns the radio
+ */
+static int __tx_busy;
+static int64_t __tx_deadline;
+static lora_tx_done_cb_t __tx_done;
+static void *__tx_arg;
+
 /**
- * Write a value to a register.
- * @param reg Register index.
- * @param val Value to write.
+ * Run a single SPI transaction with the chip selected.
+ * Register accesses fit into the transaction itself, so the
+ * hot paths (IRQ flags, modem status, CAD) never set up DMA.
+ * @param out Bytes to send.
+ * @param in Buffer for the received bytes, NULL if they are not needed.
+ * @param len Number of bytes to transfer in each direction.
  */
-void lora_write_reg(int reg, int val)
+static void lora_transfer(const uint8_t *out, uint8_t *in, size_t len)
 {
-   uint8_t out[2] = {0x80 | reg, val};
-   uint8_t in[2];
-
    spi_transaction_t t = {
        .flags = 0,
-       .length = 8 * sizeof(out),
-       .tx_buffer = out,
-       .rx_buffer = in};
+       .length = 8 * len};
+
+   if (len <= LORA_SPI_INLINE_SIZE)
+   {
+      t.flags = SPI_TRANS_USE_TXDATA | SPI_TRANS_USE_RXDATA;
+      memcpy(t.tx_data, out, len);
+   }
+   else
+   {
+      t.tx_buffer = out;
+      t.rx_buffer = in;
+   }
 
    gpio_set_level(CONFIG_CS_GPIO, 0);
    spi_device_transmit(__spi, &t);
    gpio_set_level(CONFIG_CS_GPIO, 1);
+
+   if (len <= LORA_SPI_INLINE_SIZE && in != NULL)
+      memcpy(in, t.rx_data, len);
+
+   __spi_stats.transactions++;
+   __spi_stats.bytes += len;
+}
+
+/**
+ * Write a value to a register.
+ * @param reg Register index.
+ * @param val Value to write.
+ */
+void lora_write_reg(int reg, int val)
+{
+   uint8_t out[2] = {0x80 | reg, val};
+
+   lora_transfer(out, NULL, sizeof(out));
 }
 
 /**
@@ -103,18 +217,87 @@ int lora_read_reg(int reg)
    uint8_t out[2] = {reg, 0xff};
    uint8_t in[2];
 
-   spi_transaction_t t = {
-       .flags = 0,
-       .length = 8 * sizeof(out),
-       .tx_buffer = out,
-       .rx_buffer = in};
-
-   gpio_set_level(CONFIG_CS_GPIO, 0);
-   spi_device_transmit(__spi, &t);
-   gpio_set_level(CONFIG_CS_GPIO, 1);
+   lora_transfer(out, in, sizeof(out));
    return in[1];
 }
 
+/**
+ * Write consecutive registers in a single burst transaction.
+ * Longer FIFO writes are padded to whole words, the padding lands behind
+ * the payload and is never sent. Register bursts are not padded,
+ * it would overwrite the registers which follow.
+ * @param reg Index of the first register.
+ * @param buf Values to write.
+ * @param size Number of registers, at most LORA_FIFO_SIZE.
+ */
+static void lora_write_burst(int reg, const uint8_t *buf, int size)
+{
+   int len;
+
+   if (size > LORA_FIFO_SIZE)
+      size = LORA_FIFO_SIZE;
+
+   len = size + 1;
+   /*
+    * Padding a full FIFO would wrap around onto the start of the payload
+    */
+   if (reg == REG_FIFO && len > LORA_SPI_INLINE_SIZE && LORA_SPI_ALIGN(len) <= LORA_FIFO_SIZE + 1)
+      len = LORA_SPI_ALIGN(len);
+
+   __fifo_out[0] = 0x80 | reg;
+   memcpy(__fifo_out + 1, buf, size);
+   memset(__fifo_out + 1 + size, 0, len - 1 - size);
+   lora_transfer(__fifo_out, NULL, len);
+}
+
+/**
+ * Read consecutive registers in a single burst transaction.
+ * @param reg Index of the first register.
+ * @param buf Buffer for the values.
+ * @param size Number of registers, at most LORA_FIFO_SIZE.
+ */
+static void lora_read_burst(int reg, uint8_t *buf, int size)
+{
+   int len;
+
+   if (size > LORA_FIFO_SIZE)
+      size = LORA_FIFO_SIZE;
+
+   /*
+    * Burst reads are padded to whole words, the extra
+    * bytes only move the address pointer and are dropped
+    */
+   len = size + 1;
+   if (len > LORA_SPI_INLINE_SIZE)
+      len = LORA_SPI_ALIGN(len);
+
+   __fifo_out[0] = reg;
+   memset(__fifo_out + 1, 0xff, len - 1);
+   lora_transfer(__fifo_out, __fifo_in, len);
+   memcpy(buf, __fifo_in + 1, size);
+}
+
+/**
+ * Write a block of data into the FIFO in a single burst transaction.
+ * The FIFO address pointer advances by itself after every byte.
+ * @param buf Data to write.
+ * @param size Number of bytes, at most LORA_FIFO_SIZE.
+ */
+void lora_write_fifo(const uint8_t *buf, int size)
+{
+   lora_write_burst(REG_FIFO, buf, size);
+}
+
+/**
+ * Read a block of data from the FIFO in a single burst transaction.
+ * @param buf Buffer for the data.
+ * @param size Number of bytes, at most LORA_FIFO_SIZE.
+ */
+void lora_read_fifo(uint8_t *buf, int size)
+{
+   lora_read_burst(REG_FIFO, buf, size);
+}
+
 /**
  * Perform physical reset on the Lora chip
  */
@@ -126,6 +309,126 @@ void lora_reset(void)
    vTaskDelay(pdMS_TO_TICKS(10));
 }
 
+/**
+ * Update the REG_MODEM_CONFIG_1 shadow and write it through.
+ * The SPI write is skipped when the value does not change.
+ */
+static void lora_write_modem_config_1(uint8_t val)
+{
+   if (val == __modem_config_1)
+      return;
+   __modem_config_1 = val;
+   lora_write_reg(REG_MODEM_CONFIG_1, val);
+}
+
+/**
+ * Update the REG_MODEM_CONFIG_2 shadow and write it through.
+ * The SPI write is skipped when the value does not change.
+ */
+static void lora_write_modem_config_2(uint8_t val)
+{
+   if (val == __modem_config_2)
+      return;
+   __modem_config_2 = val;
+   lora_write_reg(REG_MODEM_CONFIG_2, val);
+}
+
+/**
+ * Write the detection settings which belong to a spreading factor.
+ * @param sf 6-12, Spreading factor to use.
+ */
+static void lora_write_detection(int sf)
+{
+   if (sf == 6)
+   {
+      lora_write_reg(REG_DETECTION_OPTIMIZE, 0xc5);
+      lora_write_reg(REG_DETECTION_THRESHOLD, 0x0c);
+   }
+   else
+   {
+      lora_write_reg(REG_DETECTION_OPTIMIZE, 0xc3);
+      lora_write_reg(REG_DETECTION_THRESHOLD, 0x0a);
+   }
+}
+
+/**
+ * Clamp a spreading factor to 6-12.
+ */
+static int lora_clamp_spreading_factor(int sf)
+{
+   if (sf < 6)
+      return 6;
+   if (sf > 12)
+      return 12;
+   return sf;
+}
+
+/**
+ * Clamp a coding rate denominator to 5-8.
+ */
+static int lora_clamp_coding_rate(int denominator)
+{
+   if (denominator < 5)
+      return 5;
+   if (denominator > 8)
+      return 8;
+   return denominator;
+}
+
+/**
+ * Map a bandwidth in Hz to the REG_MODEM_CONFIG_1 bandwidth field.
+ */
+static int lora_bandwidth_index(long sbw)
+{
+   int bw = 0;
+
+   while (bw < (int)(sizeof(__bandwidths) / sizeof(__bandwidths[0])) - 1 && sbw > __bandwidths[bw])
+      bw++;
+   return bw;
+}
+
+/**
+ * Return the bandwidth in Hz from the REG_MODEM_CONFIG_1 shadow.
+ */
+static long lora_current_bandwidth(void)
+{
+   int bw = __modem_config_1 >> 4;
+
+   if (bw >= (int)(sizeof(__bandwidths) / sizeof(__bandwidths[0])))
+      bw = sizeof(__bandwidths) / sizeof(__bandwidths[0]) - 1;
+   return __bandwidths[bw];
+}
+
+/**
+ * Set or clear the low data rate optimization bit of REG_MODEM_CONFIG_3.
+ * It is required once a symbol lasts longer than 16 ms, lora_time_on_air_us()
+ * assumes the same. The SPI write is skipped when the bit does not change.
+ * @param sf Spreading factor.
+ * @param bandwidth Bandwidth in Hz.
+ */
+static void lora_write_low_data_rate(int sf, long bandwidth)
+{
+   int64_t symbol_ns = ((int64_t)1000000000 << sf) / bandwidth;
+   uint8_t val = symbol_ns > 16000000 ? (__modem_config_3 | 0x08) : (__modem_config_3 & 0xf7);
+
+   if (val == __modem_config_3)
+      return;
+   __modem_config_3 = val;
+   lora_write_reg(REG_MODEM_CONFIG_3, val);
+}
+
+/**
+ * Convert a frequency in Hz to the REG_FRF_* register values.
+ */
+static void lora_frequency_to_frf(long frequency, uint8_t frf[3])
+{
+   uint64_t val = ((uint64_t)frequency << 19) / 32000000;
+
+   frf[0] = (uint8_t)(val >> 16);
+   frf[1] = (uint8_t)(val >> 8);
+   frf[2] = (uint8_t)(val >> 0);
+}
+
 /**
  * Configure explicit header mode.
  * Packet size will be included in the frame.
@@ -133,7 +436,7 @@ void lora_reset(void)
 void lora_explicit_header_mode(void)
 {
    __implicit = 0;
-   lora_write_reg(REG_MODEM_CONFIG_1, lora_read_reg(REG_MODEM_CONFIG_1) & 0xfe);
+   lora_write_modem_config_1(__modem_config_1 & 0xfe);
 }
 
 /**
@@ -144,7 +447,8 @@ void lora_explicit_header_mode(void)
 void lora_implicit_header_mode(int size)
 {
    __implicit = 1;
-   lora_write_reg(REG_MODEM_CONFIG_1, lora_read_reg(REG_MODEM_CONFIG_1) | 0x01);
+   __payload_length = size;
+   lora_write_modem_config_1(__modem_config_1 | 0x01);
    lora_write_reg(REG_PAYLOAD_LENGTH, size);
 }
 
@@ -195,13 +499,12 @@ void lora_set_tx_power(int level)
  */
 void lora_set_frequency(long frequency)
 {
-   __frequency = frequency;
+   uint8_t frf[3];
 
-   uint64_t frf = ((uint64_t)frequency << 19) / 32000000;
+   __frequency = frequency;
 
-   lora_write_reg(REG_FRF_MSB, (uint8_t)(frf >> 16));
-   lora_write_reg(REG_FRF_MID, (uint8_t)(frf >> 8));
-   lora_write_reg(REG_FRF_LSB, (uint8_t)(frf >> 0));
+   lora_frequency_to_frf(frequency, frf);
+   lora_write_burst(REG_FRF_MSB, frf, sizeof(frf));
 }
 
 /**
@@ -210,23 +513,11 @@ void lora_set_frequency(long frequency)
  */
 void lora_set_spreading_factor(int sf)
 {
-   if (sf < 6)
-      sf = 6;
-   else if (sf > 12)
-      sf = 12;
-
-   if (sf == 6)
-   {
-      lora_write_reg(REG_DETECTION_OPTIMIZE, 0xc5);
-      lora_write_reg(REG_DETECTION_THRESHOLD, 0x0c);
-   }
-   else
-   {
-      lora_write_reg(REG_DETECTION_OPTIMIZE, 0xc3);
-      lora_write_reg(REG_DETECTION_THRESHOLD, 0x0a);
-   }
+   sf = lora_clamp_spreading_factor(sf);
 
-   lora_write_reg(REG_MODEM_CONFIG_2, (lora_read_reg(REG_MODEM_CONFIG_2) & 0x0f) | ((sf << 4) & 0xf0));
+   lora_write_detection(sf);
+   lora_write_modem_config_2((__modem_config_2 & 0x0f) | ((sf << 4) & 0xf0));
+   lora_write_low_data_rate(sf, lora_current_bandwidth());
 }
 
 /**
@@ -235,29 +526,10 @@ void lora_set_spreading_factor(int sf)
  */
 void lora_set_bandwidth(long sbw)
 {
-   int bw;
-
-   if (sbw <= 7.8E3)
-      bw = 0;
-   else if (sbw <= 10.4E3)
-      bw = 1;
-   else if (sbw <= 15.6E3)
-      bw = 2;
-   else if (sbw <= 20.8E3)
-      bw = 3;
-   else if (sbw <= 31.25E3)
-      bw = 4;
-   else if (sbw <= 41.7E3)
-      bw = 5;
-   else if (sbw <= 62.5E3)
-      bw = 6;
-   else if (sbw <= 125E3)
-      bw = 7;
-   else if (sbw <= 250E3)
-      bw = 8;
-   else
-      bw = 9;
-   lora_write_reg(REG_MODEM_CONFIG_1, (lora_read_reg(REG_MODEM_CONFIG_1) & 0x0f) | (bw << 4));
+   int bw = lora_bandwidth_index(sbw);
+
+   lora_write_modem_config_1((__modem_config_1 & 0x0f) | (bw << 4));
+   lora_write_low_data_rate(__modem_config_2 >> 4, __bandwidths[bw]);
 }
 
 /**
@@ -266,13 +538,9 @@ void lora_set_bandwidth(long sbw)
  */
 void lora_set_coding_rate(int denominator)
 {
-   if (denominator < 5)
-      denominator = 5;
-   else if (denominator > 8)
-      denominator = 8;
+   int cr = lora_clamp_coding_rate(denominator) - 4;
 
-   int cr = denominator - 4;
-   lora_write_reg(REG_MODEM_CONFIG_1, (lora_read_reg(REG_MODEM_CONFIG_1) & 0xf1) | (cr << 1));
+   lora_write_modem_config_1((__modem_config_1 & 0xf1) | (cr << 1));
 }
 
 /**
@@ -281,8 +549,10 @@ void lora_set_coding_rate(int denominator)
  */
 void lora_set_preamble_length(long length)
 {
-   lora_write_reg(REG_PREAMBLE_MSB, (uint8_t)(length >> 8));
-   lora_write_reg(REG_PREAMBLE_LSB, (uint8_t)(length >> 0));
+   uint8_t preamble[2] = {(uint8_t)(length >> 8), (uint8_t)(length >> 0)};
+
+   __preamble_length = (uint16_t)length;
+   lora_write_burst(REG_PREAMBLE_MSB, preamble, sizeof(preamble));
 }
 
 /**
@@ -299,7 +569,7 @@ void lora_set_sync_word(int sw)
  */
 void lora_enable_crc(void)
 {
-   lora_write_reg(REG_MODEM_CONFIG_2, lora_read_reg(REG_MODEM_CONFIG_2) | 0x04);
+   lora_write_modem_config_2(__modem_config_2 | 0x04);
 }
 
 /**
@@ -307,7 +577,75 @@ void lora_enable_crc(void)
  */
 void lora_disable_crc(void)
 {
-   lora_write_reg(REG_MODEM_CONFIG_2, lora_read_reg(REG_MODEM_CONFIG_2) & 0xfb);
+   lora_write_modem_config_2(__modem_config_2 & 0xfb);
+}
+
+/**
+ * Apply a whole modem profile in one batched sequence.
+ * Register values are computed from the shadows, consecutive registers
+ * are written in burst transactions and unchanged ones are skipped.
+ * Nothing is read back over SPI. The radio is left in idle mode.
+ * @param profile Modem profile to apply.
+ */
+void lora_apply_profile(const lora_modem_profile_t *profile)
+{
+   int sf = lora_clamp_spreading_factor(profile->spreading_factor);
+   int cr = lora_clamp_coding_rate(profile->coding_rate) - 4;
+   int bw = lora_bandwidth_index(profile->bandwidth);
+   uint8_t config[2];
+   uint8_t frf[3];
+
+   config[0] = (bw << 4) | (cr << 1) | (profile->implicit_header ? 0x01 : 0x00);
+   config[1] = (__modem_config_2 & 0x0b) | ((sf << 4) & 0xf0) | (profile->crc ? 0x04 : 0x00);
+
+   lora_idle();
+
+   if (profile->frequency != __frequency)
+   {
+      __frequency = profile->frequency;
+      lora_frequency_to_frf(profile->frequency, frf);
+      lora_write_burst(REG_FRF_MSB, frf, sizeof(frf));
+   }
+
+   if ((config[1] & 0xf0) != (__modem_config_2 & 0xf0))
+      lora_write_detection(sf);
+
+   /*
+    * REG_MODEM_CONFIG_1 and REG_MODEM_CONFIG_2 are adjacent
+    */
+   if (config[0] != __modem_config_1 || config[1] != __modem_config_2)
+   {
+      __modem_config_1 = config[0];
+      __modem_config_2 = config[1];
+      lora_write_burst(REG_MODEM_CONFIG_1, config, sizeof(config));
+   }
+
+   lora_write_low_data_rate(sf, __bandwidths[bw]);
+
+   __implicit = profile->implicit_header ? 1 : 0;
+   if (__implicit && profile->implicit_header != __payload_length)
+   {
+      __payload_length = profile->implicit_header;
+      lora_write_reg(REG_PAYLOAD_LENGTH, __payload_length);
+   }
+
+   if (profile->preamble_length != __preamble_length)
+      lora_set_preamble_length(profile->preamble_length);
+}
+
+/**
+ * Return the current modem profile from the register shadows, without SPI traffic.
+ * @param profile Filled with the current configuration.
+ */
+void lora_get_profile(lora_modem_profile_t *profile)
+{
+   profile->frequency = __frequency;
+   profile->spreading_factor = __modem_config_2 >> 4;
+   profile->bandwidth = lora_current_bandwidth();
+   profile->coding_rate = ((__modem_config_1 >> 1) & 0x07) + 4;
+   profile->preamble_length = __preamble_length;
+   profile->crc = (__modem_config_2 & 0x04) ? 1 : 0;
+   profile->implicit_header = __implicit ? __payload_length : 0;
 }
 
 /**
@@ -331,9 +669,9 @@ int lora_init(void)
        .sclk_io_num = CONFIG_SCK_GPIO,
        .quadwp_io_num = -1,
        .quadhd_io_num = -1,
-       .max_transfer_sz = 0};
+       .max_transfer_sz = sizeof(__fifo_out)};
 
-   ret = spi_bus_initialize(SPI2_HOST, &bus, 0);
+   ret = spi_bus_initialize(SPI2_HOST, &bus, SPI_DMA_CH_AUTO);
    assert(ret == ESP_OK);
 
    spi_device_interface_config_t dev = {
@@ -371,10 +709,26 @@ int lora_init(void)
     * Default configuration.
     */
    lora_sleep();
+
+   /*
+    * Load the register shadows once, every later change is written through them.
+    */
+   __modem_config_1 = lora_read_reg(REG_MODEM_CONFIG_1);
+   __modem_config_2 = lora_read_reg(REG_MODEM_CONFIG_2);
+   __preamble_length = (lora_read_reg(REG_PREAMBLE_MSB) << 8) | lora_read_reg(REG_PREAMBLE_LSB);
+   __payload_length = lora_read_reg(REG_PAYLOAD_LENGTH);
+   __implicit = __modem_config_1 & 0x01;
+
    lora_write_reg(REG_FIFO_RX_BASE_ADDR, 0);
    lora_write_reg(REG_FIFO_TX_BASE_ADDR, 0);
    lora_write_reg(REG_LNA, lora_read_reg(REG_LNA) | 0x03);
-   lora_write_reg(REG_MODEM_CONFIG_3, 0x04);
+
+   /*
+    * AGC on, low data rate optimization as the spreading factor and bandwidth need it.
+    */
+   __modem_config_3 = 0x04;
+   lora_write_reg(REG_MODEM_CONFIG_3, __modem_config_3);
+   lora_write_low_data_rate(__modem_config_2 >> 4, lora_current_bandwidth());
    lora_set_tx_power(17);
 
    lora_idle();
@@ -393,9 +747,7 @@ void lora_send_packet(uint8_t *buf, int size)
     */
    lora_idle();
    lora_write_reg(REG_FIFO_ADDR_PTR, 0);
-
-   for (int i = 0; i < size; i++)
-      lora_write_reg(REG_FIFO, *buf++);
+   lora_write_fifo(buf, size);
 
    lora_write_reg(REG_PAYLOAD_LENGTH, size);
 
@@ -409,6 +761,139 @@ void lora_send_packet(uint8_t *buf, int size)
    lora_write_reg(REG_IRQ_FLAGS, IRQ_TX_DONE_MASK);
 }
 
+/**
+ * Route an event to the DIO0 pin, if the interrupt is in use.
+ * @param mapping DIO0_MAPPING_RX_DONE or DIO0_MAPPING_TX_DONE.
+ */
+static void lora_map_dio0(uint8_t mapping)
+{
+   if (__irq_task != NULL)
+   {
+      __dio0_mapping = mapping;
+      lora_write_reg(REG_DIO_MAPPING_1, (lora_read_reg(REG_DIO_MAPPING_1) & ~DIO0_MAPPING_MASK) | mapping);
+   }
+}
+
+/**
+ * Start sending a packet without waiting for it.
+ * TxDone is routed to DIO0 so the task registered with
+ * lora_enable_rx_interrupt() is notified when it ends, the task then
+ * calls lora_tx_poll() which returns the radio to continuous receive
+ * and runs the callback. The radio can not receive while sending.
+ * @param buf Data to be sent, copied into the FIFO before returning.
+ * @param size Size of data.
+ * @param done Called from lora_tx_poll() when the transmission ended, may be NULL.
+ * @param arg Passed to the callback.
+ * @return Non-zero if the transmission started, zero if one is still in progress.
+ */
+int lora_send_packet_async(const uint8_t *buf, int size, lora_tx_done_cb_t done, void *arg)
+{
+   lora_modem_profile_t profile;
+
+   if (__tx_busy)
+      return 0;
+
+   lora_idle();
+   lora_write_reg(REG_FIFO_ADDR_PTR, 0);
+   lora_write_fifo(buf, size);
+   lora_write_reg(REG_PAYLOAD_LENGTH, size);
+   lora_write_reg(REG_IRQ_FLAGS, IRQ_TX_DONE_MASK);
+   lora_map_dio0(DIO0_MAPPING_TX_DONE);
+
+   /*
+    * Gives up on TxDone after twice the time on air
+    */
+   lora_get_profile(&profile);
+   __tx_deadline = esp_timer_get_time() + 2 * lora_time_on_air_us(&profile, size) + 10000;
+   __tx_done = done;
+   __tx_arg = arg;
+   __tx_busy = 1;
+
+   lora_write_reg(REG_OP_MODE, MODE_LONG_RANGE_MODE | MODE_TX);
+   return 1;
+}
+
+/**
+ * Returns non-zero while an asynchronous transmission is in progress.
+ */
+int lora_tx_busy(void)
+{
+   return __tx_busy;
+}
+
+/**
+ * Finish an asynchronous transmission once TxDone is set or its deadline passed.
+ * Puts the radio back into continuous receive before running the callback.
+ * Cheap to call when nothing is being sent.
+ */
+void lora_tx_poll(void)
+{
+   if (!__tx_busy)
+      return;
+
+   int done = lora_read_reg(REG_IRQ_FLAGS) & IRQ_TX_DONE_MASK;
+   if (!done && esp_timer_get_time() < __tx_deadline)
+      return;
+
+   lora_write_reg(REG_IRQ_FLAGS, IRQ_TX_DONE_MASK);
+   lora_map_dio0(DIO0_MAPPING_RX_DONE);
+   __tx_busy = 0;
+   lora_receive();
+
+   if (__tx_done != NULL)
+      __tx_done(done != 0, __tx_arg);
+}
+
+/**
+ * Start a channel activity detection on the current profile.
+ * CadDone is routed to DIO0 like TxDone, the notified task
+ * collects the result with lora_cad_poll().
+ */
+void lora_cad_start(void)
+{
+   lora_idle();
+   lora_write_reg(REG_IRQ_FLAGS, IRQ_CAD_DONE_MASK | IRQ_CAD_DETECTED_MASK);
+   lora_map_dio0(DIO0_MAPPING_CAD_DONE);
+   lora_write_reg(REG_OP_MODE, MODE_LONG_RANGE_MODE | MODE_CAD);
+}
+
+/**
+ * Collect the result of lora_cad_start().
+ * The radio is left in standby once the detection is done.
+ * @return -1 while the detection runs, 1 if a preamble was detected, 0 otherwise.
+ */
+int lora_cad_poll(void)
+{
+   int irq = lora_read_reg(REG_IRQ_FLAGS);
+
+   if ((irq & IRQ_CAD_DONE_MASK) == 0)
+      return -1;
+
+   lora_write_reg(REG_IRQ_FLAGS, IRQ_CAD_DONE_MASK | IRQ_CAD_DETECTED_MASK);
+   lora_map_dio0(DIO0_MAPPING_RX_DONE);
+   return (irq & IRQ_CAD_DETECTED_MASK) ? 1 : 0;
+}
+
+/**
+ * Abort a detection started with lora_cad_start() and route
+ * RxDone back to DIO0. The radio is left in standby.
+ */
+void lora_cad_stop(void)
+{
+   lora_idle();
+   lora_write_reg(REG_IRQ_FLAGS, IRQ_CAD_DONE_MASK | IRQ_CAD_DETECTED_MASK);
+   lora_map_dio0(DIO0_MAPPING_RX_DONE);
+}
+
+/**
+ * Returns non-zero while the modem is locked on a packet, from the
+ * preamble until RxDone. Switching the profile then would lose it.
+ */
+int lora_rx_in_progress(void)
+{
+   return lora_read_reg(REG_MODEM_STAT) & (MODEM_STAT_SIGNAL_SYNCHRONIZED | MODEM_STAT_HEADER_VALID);
+}
+
 /**
  * Read a received packet.
  * @param buf Buffer for the data.
@@ -444,8 +929,8 @@ int lora_receive_packet(uint8_t *buf, int size)
    lora_write_reg(REG_FIFO_ADDR_PTR, lora_read_reg(REG_FIFO_RX_CURRENT_ADDR));
    if (len > size)
       len = size;
-   for (int i = 0; i < len; i++)
-      *buf++ = lora_read_reg(REG_FIFO);
+   if (len > 0)
+      lora_read_fifo(buf, len);
 
    return len;
 }
@@ -476,6 +961,52 @@ float lora_packet_snr(void)
    return ((int8_t)lora_read_reg(REG_PKT_SNR_VALUE)) * 0.25;
 }
 
+/**
+ * Convert the raw 20 bit REG_FEI value to a frequency error in Hz.
+ * Ferr = FreqError * 2^24 / Fxtal * BW / 500 kHz, with a 32 MHz crystal.
+ */
+static long lora_fei_to_hz(const uint8_t fei[3])
+{
+   int32_t raw = ((fei[0] & 0x0f) << 16) | (fei[1] << 8) | fei[2];
+
+   if (raw & 0x80000)
+      raw -= 0x100000;
+   return (long)((int64_t)raw * (1 << 24) * lora_current_bandwidth() / (32000000LL * 500000));
+}
+
+/**
+ * Return last packet's carrier frequency error in Hz.
+ */
+long lora_packet_freq_error(void)
+{
+   uint8_t fei[3];
+
+   lora_read_burst(REG_FEI_MSB, fei, sizeof(fei));
+   return lora_fei_to_hz(fei);
+}
+
+/**
+ * Read the link quality of the last received packet.
+ * Takes two burst transactions instead of one read per register,
+ * call it before the radio receives the next packet.
+ * @param meta Filled with RSSI, SNR and frequency error.
+ */
+void lora_read_packet_meta(lora_packet_meta_t *meta)
+{
+   uint8_t pkt[2];
+   uint8_t fei[3];
+
+   /*
+    * REG_PKT_SNR_VALUE and REG_PKT_RSSI_VALUE are adjacent.
+    */
+   lora_read_burst(REG_PKT_SNR_VALUE, pkt, sizeof(pkt));
+   lora_read_burst(REG_FEI_MSB, fei, sizeof(fei));
+
+   meta->snr = (int8_t)pkt[0];
+   meta->rssi = pkt[1] - (__frequency < 868E6 ? 164 : 157);
+   meta->freq_error = lora_fei_to_hz(fei);
+}
+
 /**
  * Shutdown hardware.
  */
@@ -502,3 +1033,161 @@ void lora_dump_registers(void)
    }
    printf("\n");
 }
+
+#if CONFIG_LORA_RX_INTERRUPT
+/**
+ * DIO0 interrupt handler.
+ * Records the time of an RxDone interrupt and wakes up the waiting task.
+ */
+static void IRAM_ATTR lora_dio0_isr(void *arg)
+{
+   BaseType_t woken = pdFALSE;
+
+   if (__dio0_mapping == DIO0_MAPPING_RX_DONE)
+   {
+      portENTER_CRITICAL_ISR(&__irq_lock);
+      __irq_time = esp_timer_get_time();
+      __irq_time_valid = 1;
+      portEXIT_CRITICAL_ISR(&__irq_lock);
+   }
+   vTaskNotifyGiveFromISR(__irq_task, &woken);
+   portYIELD_FROM_ISR(woken);
+}
+#endif
+
+/**
+ * Route RxDone to the DIO0 pin and notify a task when it fires.
+ * The task can block on ulTaskNotifyTake() instead of polling REG_IRQ_FLAGS.
+ * @param task Task to notify on every received packet.
+ * @return Non-zero if the interrupt is enabled, zero if the caller has to poll.
+ */
+int lora_enable_rx_interrupt(TaskHandle_t task)
+{
+#if CONFIG_LORA_RX_INTERRUPT
+   esp_err_t ret;
+
+   __irq_task = task;
+
+   gpio_config_t io = {
+       .pin_bit_mask = 1ULL << CONFIG_DIO0_GPIO,
+       .mode = GPIO_MODE_INPUT,
+       .pull_up_en = GPIO_PULLUP_DISABLE,
+       .pull_down_en = GPIO_PULLDOWN_ENABLE,
+       .intr_type = GPIO_INTR_POSEDGE};
+   if (gpio_config(&io) != ESP_OK)
+      return 0;
+
+   /*
+    * The ISR service may already be installed by another driver.
+    */
+   ret = gpio_install_isr_service(ESP_INTR_FLAG_IRAM);
+   if (ret != ESP_OK && ret != ESP_ERR_INVALID_STATE)
+      return 0;
+   if (gpio_isr_handler_add(CONFIG_DIO0_GPIO, lora_dio0_isr, NULL) != ESP_OK)
+      return 0;
+
+   __dio0_mapping = DIO0_MAPPING_RX_DONE;
+   lora_write_reg(REG_DIO_MAPPING_1, (lora_read_reg(REG_DIO_MAPPING_1) & ~DIO0_MAPPING_MASK) | DIO0_MAPPING_RX_DONE);
+   return 1;
+#else
+   return 0;
+#endif
+}
+
+/**
+ * Stop notifying the task on received packets.
+ */
+void lora_disable_rx_interrupt(void)
+{
+#if CONFIG_LORA_RX_INTERRUPT
+   gpio_isr_handler_remove(CONFIG_DIO0_GPIO);
+#endif
+   __irq_task = NULL;
+}
+
+/**
+ * Return the esp_timer time (in microseconds) of the RxDone interrupt of
+ * the packet being read. If there was none since the last call, because
+ * the edge was missed or the wake up had another cause, the current time.
+ */
+int64_t lora_last_irq_time(void)
+{
+   int64_t time;
+   int valid;
+
+   portENTER_CRITICAL(&__irq_lock);
+   time = __irq_time;
+   valid = __irq_time_valid;
+   __irq_time_valid = 0;
+   portEXIT_CRITICAL(&__irq_lock);
+
+   return valid ? time : esp_timer_get_time();
+}
+
+/**
+ * Return the number of SPI transactions and bytes since the last reset.
+ */
+void lora_get_spi_stats(lora_spi_stats_t *stats)
+{
+   *stats = __spi_stats;
+}
+
+/**
+ * Reset the SPI transaction counters.
+ */
+void lora_reset_spi_stats(void)
+{
+   memset(&__spi_stats, 0, sizeof(__spi_stats));
+}
+
+/**
+ * Compare reading the FIFO byte by byte with a single burst transaction.
+ * Logs the SPI transactions and the time spent per byte of both methods.
+ * The radio is left in idle mode.
+ * @param size Bytes read per packet, at most LORA_FIFO_SIZE.
+ * @param iterations Number of packets to read with each method.
+ */
+void lora_benchmark_fifo(int size, int iterations)
+{
+   lora_spi_stats_t stats;
+   int64_t start;
+   int64_t elapsed;
+   /*
+    * Separate from __fifo_in, which the burst read copies from
+    */
+   uint8_t buf[LORA_FIFO_SIZE];
+
+   if (size > LORA_FIFO_SIZE)
+      size = LORA_FIFO_SIZE;
+   if (size <= 0 || iterations <= 0)
+      return;
+
+   lora_idle();
+
+   lora_reset_spi_stats();
+   start = esp_timer_get_time();
+   for (int n = 0; n < iterations; n++)
+   {
+      lora_write_reg(REG_FIFO_ADDR_PTR, 0);
+      for (int i = 0; i < size; i++)
+         buf[i] = lora_read_reg(REG_FIFO);
+   }
+   elapsed = esp_timer_get_time() - start;
+   lora_get_spi_stats(&stats);
+   ESP_LOGI("LoRa", "FIFO byte read: %" PRIu32 " transactions, %.3f us/byte",
+            stats.transactions, (double)elapsed / ((double)size * iterations));
+
+   lora_reset_spi_stats();
+   start = esp_timer_get_time();
+   for (int n = 0; n < iterations; n++)
+   {
+      lora_write_reg(REG_FIFO_ADDR_PTR, 0);
+      lora_read_fifo(buf, size);
+   }
+   elapsed = esp_timer_get_time() - start;
+   lora_get_spi_stats(&stats);
+   ESP_LOGI("LoRa", "FIFO burst read: %" PRIu32 " transactions, %.3f us/byte",
+            stats.transactions, (double)elapsed / ((double)size * iterations));
+
+   lora_reset_spi_stats();
+}
@@ -0,0 +1,34 @@
+#include <stdint.h>
+#include "sx1278.h"
+
+/**
+ * Time a packet spends on the air, following the SX1276/77/78 datasheet.
+ * Shared by the radio driver and the simulated radio.
+ * @param profile Modem configuration the packet is sent with.
+ * @param size Payload size in bytes.
+ * @return Time on air in microseconds.
+ */
+long lora_time_on_air_us(const lora_modem_profile_t *profile, int size)
+{
+   int sf = profile->spreading_factor;
+   int cr = profile->coding_rate - 4;
+   int64_t symbol_ns = ((int64_t)1000000000 << sf) / profile->bandwidth;
+
+   /*
+    * Low data rate optimization, the driver turns it on once a symbol exceeds 16 ms
+    */
+   int de = symbol_ns > 16000000 ? 1 : 0;
+   int numerator = 8 * size - 4 * sf + 28 + (profile->crc ? 16 : 0) - (profile->implicit_header ? 20 : 0);
+   int denominator = 4 * (sf - 2 * de);
+   int payload_symbols = 8;
+
+   if (numerator > 0)
+      payload_symbols += (numerator + denominator - 1) / denominator * (cr + 4);
+
+   /*
+    * The preamble is followed by 4.25 symbols of sync word and start frame delimiter
+    */
+   int64_t preamble_ns = (profile->preamble_length * 4 + 17) * symbol_ns / 4;
+
+   return (long)((preamble_ns + payload_symbols * symbol_ns) / 1000);
+}
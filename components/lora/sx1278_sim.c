@@ -0,0 +1,779 @@
+#include "sx1278.h"
+#include "sx1278_sim.h"
+#include "freertos/FreeRTOS.h"
+#include "freertos/task.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <inttypes.h>
+#include <time.h>
+#include <pthread.h>
+#include "esp_log.h"
+
+/*
+ * Simulated SX1278 for the linux target.
+ * Implements the sx1278.h API on top of a generator task which puts
+ * synthetic or recorded packets "on the air" at the configured rate.
+ * The receiver sees them through a FIFO of CONFIG_LORA_SIM_FIFO_DEPTH
+ * packets, a depth of one behaves like the real radio which only
+ * holds the last received packet.
+ */
+
+#define TAG "LoRaSim"
+
+/*
+ * Largest packet of the radio
+ */
+#define LORA_SIM_PACKET_SIZE 255
+
+/*
+ * Recently sent packets which may be repeated as duplicates
+ */
+#define LORA_SIM_RECENT 16
+
+/*
+ * Send times remembered for the latency lookup, power of two
+ */
+#define LORA_SIM_SENT_HISTORY 4096
+
+/*
+ * Spreading factors 6 to 12 index the per spreading factor state
+ */
+#define LORA_SIM_SF_MAX 12
+
+/*
+ * What the receiver does, set by the mode calls of the API
+ */
+#define LORA_SIM_MODE_RX 0
+#define LORA_SIM_MODE_CAD 1
+#define LORA_SIM_MODE_IDLE 2
+
+typedef struct
+{
+   uint8_t data[LORA_SIM_PACKET_SIZE];
+   uint8_t size;
+   int64_t time;
+} lora_sim_packet_t;
+
+typedef struct
+{
+   uint32_t node_id;
+   uint32_t message_id;
+   int64_t time;
+} lora_sim_sent_t;
+
+static lora_modem_profile_t __profile = {
+    .frequency = 433e6,
+    .bandwidth = 125e3,
+    .spreading_factor = 7,
+    .coding_rate = 5,
+    .preamble_length = 8,
+    .crc = 0,
+    .implicit_header = 0};
+static int __initialized = 0;
+
+static lora_sim_packet_t __fifo[CONFIG_LORA_SIM_FIFO_DEPTH];
+static int __fifo_head = 0;
+static int __fifo_count = 0;
+static portMUX_TYPE __fifo_lock = portMUX_INITIALIZER_UNLOCKED;
+
+static TaskHandle_t __irq_task = NULL;
+static int64_t __irq_time = 0;
+static lora_packet_meta_t __meta = {.rssi = -90, .snr = 30, .freq_error = 0};
+
+static lora_sim_stats_t __stats;
+
+/*
+ * Spreading factors of the nodes, empty if every node uses the receiver's
+ */
+static int __node_sf[LORA_SIM_SF_MAX];
+static int __node_sf_count = 0;
+
+/*
+ * Receiver mode and the running channel activity detection
+ */
+static volatile int __mode = LORA_SIM_MODE_RX;
+static int64_t __cad_start = 0;
+static volatile int64_t __cad_end = 0;
+
+/*
+ * The packet on the air on every spreading factor the receiver does not
+ * listen on. It is received if the receiver switches over before the
+ * preamble ends, a later packet on the same spreading factor replaces it
+ */
+static lora_sim_packet_t __parked[LORA_SIM_SF_MAX + 1];
+static int64_t __parked_until[LORA_SIM_SF_MAX + 1];
+static int __parked_valid[LORA_SIM_SF_MAX + 1];
+
+/*
+ * Asynchronous transmission of the receiver, the air is
+ * busy until __tx_end and the generator reports TxDone
+ */
+static volatile int __tx_busy = 0;
+static volatile int64_t __tx_end = 0;
+static lora_tx_done_cb_t __tx_done = NULL;
+static void *__tx_arg = NULL;
+
+static lora_sim_sent_t __sent[LORA_SIM_SENT_HISTORY];
+static pthread_mutex_t __sent_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static lora_sim_packet_t __recent[LORA_SIM_RECENT];
+static int __recent_count = 0;
+static uint32_t __next_message[CONFIG_LORA_SIM_NODE_COUNT];
+static uint32_t __rng = 0x2545f491;
+
+/**
+ * Monotonic host time in microseconds, shared with the benchmark sink.
+ */
+int64_t lora_sim_time(void)
+{
+   struct timespec ts;
+   clock_gettime(CLOCK_MONOTONIC, &ts);
+   return (int64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+static uint32_t lora_sim_random(void)
+{
+   /*
+    * xorshift32, deterministic so runs can be compared.
+    */
+   __rng ^= __rng << 13;
+   __rng ^= __rng >> 17;
+   __rng ^= __rng << 5;
+   return __rng;
+}
+
+static uint32_t lora_sim_read_u32(const uint8_t *buf)
+{
+   return buf[0] | (buf[1] << 8) | (buf[2] << 16) | ((uint32_t)buf[3] << 24);
+}
+
+static void lora_sim_write_u32(uint8_t *buf, uint32_t val)
+{
+   buf[0] = val & 0xff;
+   buf[1] = (val >> 8) & 0xff;
+   buf[2] = (val >> 16) & 0xff;
+   buf[3] = (val >> 24) & 0xff;
+}
+
+static lora_sim_sent_t *lora_sim_sent_entry(uint32_t node_id, uint32_t message_id)
+{
+   uint32_t hash = (node_id * 0x9e3779b1) ^ (message_id * 0x85ebca6b);
+   return &__sent[hash & (LORA_SIM_SENT_HISTORY - 1)];
+}
+
+/**
+ * Remember when a packet was first put on the air.
+ * @return Non-zero if the packet was already sent before.
+ */
+static int lora_sim_remember(const lora_sim_packet_t *packet)
+{
+   int repeated = 0;
+
+   if (packet->size < 8)
+      return 0;
+
+   uint32_t node_id = lora_sim_read_u32(packet->data);
+   uint32_t message_id = lora_sim_read_u32(packet->data + 4);
+
+   pthread_mutex_lock(&__sent_lock);
+   lora_sim_sent_t *entry = lora_sim_sent_entry(node_id, message_id);
+   if (entry->time != 0 && entry->node_id == node_id && entry->message_id == message_id)
+   {
+      repeated = 1;
+   }
+   else
+   {
+      entry->node_id = node_id;
+      entry->message_id = message_id;
+      entry->time = packet->time;
+   }
+   pthread_mutex_unlock(&__sent_lock);
+
+   return repeated;
+}
+
+/**
+ * Spreading factor a packet is sent on, -1 if it is the receiver's.
+ */
+static int lora_sim_packet_sf(const lora_sim_packet_t *packet)
+{
+   if (__node_sf_count == 0 || packet->size < 4)
+      return -1;
+   return __node_sf[lora_sim_read_u32(packet->data) % __node_sf_count];
+}
+
+/**
+ * Symbol time on the given spreading factor.
+ */
+static int64_t lora_sim_symbol_us(int sf)
+{
+   return ((int64_t)1000000 << sf) / __profile.bandwidth;
+}
+
+/**
+ * Time from the start of a packet on the given spreading factor until its preamble ends.
+ */
+static int64_t lora_sim_preamble_us(int sf)
+{
+   int64_t symbol_us = lora_sim_symbol_us(sf);
+   return (__profile.preamble_length * 4 + 17) * symbol_us / 4;
+}
+
+/**
+ * Put a packet into the FIFO. Must be called with the FIFO lock held.
+ * @return Non-zero if the FIFO was full.
+ */
+static int lora_sim_deliver(const lora_sim_packet_t *packet)
+{
+   if (__fifo_count == CONFIG_LORA_SIM_FIFO_DEPTH)
+      return 1;
+   __fifo[(__fifo_head + __fifo_count) % CONFIG_LORA_SIM_FIFO_DEPTH] = *packet;
+   __fifo_count++;
+   return 0;
+}
+
+/**
+ * Put a packet on the air. Lost if the receiver did not empty the FIFO in time.
+ */
+static void lora_sim_transmit(const lora_sim_packet_t *packet)
+{
+   int overrun = 0;
+   int sf = lora_sim_packet_sf(packet);
+
+   __stats.generated++;
+   if (lora_sim_remember(packet))
+      __stats.duplicates++;
+
+   /*
+    * Half duplex, nothing is received while the receiver transmits
+    */
+   if (__tx_busy && packet->time < __tx_end)
+   {
+      __stats.deaf++;
+      return;
+   }
+
+   portENTER_CRITICAL(&__fifo_lock);
+   if (sf >= 0 && (sf != __profile.spreading_factor || __mode != LORA_SIM_MODE_RX))
+   {
+      /*
+       * Not listening on it, the packet waits for a channel activity
+       * detection or a switch to its spreading factor
+       */
+      if (__parked_valid[sf])
+         __stats.missed++;
+      __parked[sf] = *packet;
+      __parked_until[sf] = packet->time + lora_sim_preamble_us(sf);
+      __parked_valid[sf] = 1;
+      portEXIT_CRITICAL(&__fifo_lock);
+      return;
+   }
+   overrun = lora_sim_deliver(packet);
+   portEXIT_CRITICAL(&__fifo_lock);
+
+   if (overrun)
+   {
+      __stats.overruns++;
+      return;
+   }
+
+   if (__irq_task != NULL)
+      xTaskNotifyGive(__irq_task);
+}
+
+/**
+ * Build the next synthetic packet.
+ * A share of CONFIG_LORA_SIM_DUPLICATE_PERCENT repeats a recently sent packet
+ * like a relay node would, the rest carry the next message of a random node.
+ */
+static void lora_sim_synthesize(lora_sim_packet_t *packet)
+{
+   if (__recent_count > 0 && (int)(lora_sim_random() % 100) < CONFIG_LORA_SIM_DUPLICATE_PERCENT)
+   {
+      *packet = __recent[lora_sim_random() % __recent_count];
+      return;
+   }
+
+   uint32_t node = lora_sim_random() % CONFIG_LORA_SIM_NODE_COUNT;
+
+   packet->size = CONFIG_LORA_SIM_PAYLOAD_SIZE;
+   lora_sim_write_u32(packet->data, node + 1);
+   lora_sim_write_u32(packet->data + 4, __next_message[node]++);
+   for (int i = 8; i < packet->size; i++)
+      packet->data[i] = lora_sim_random() & 0xff;
+
+   if (__recent_count < LORA_SIM_RECENT)
+      __recent[__recent_count++] = *packet;
+   else
+      __recent[lora_sim_random() % LORA_SIM_RECENT] = *packet;
+}
+
+/**
+ * Read the next packet of a recorded stream.
+ * Records are [uint32 gap in microseconds][uint8 size][size bytes], little endian.
+ * @return Gap to the previous packet, negative at the end of the stream.
+ */
+static int64_t lora_sim_replay(FILE *file, lora_sim_packet_t *packet)
+{
+   uint8_t header[5];
+
+   if (fread(header, 1, sizeof(header), file) != sizeof(header))
+      return -1;
+
+   packet->size = header[4];
+   if (fread(packet->data, 1, packet->size, file) != packet->size)
+      return -1;
+
+   return lora_sim_read_u32(header);
+}
+
+static void lora_sim_task(void *arg)
+{
+   FILE *replay = NULL;
+   lora_sim_packet_t packet;
+   int64_t interval = 1000000 / CONFIG_LORA_SIM_PACKET_RATE;
+   int64_t due = lora_sim_time();
+   int64_t gap = 0;
+
+   if (strlen(CONFIG_LORA_SIM_REPLAY_FILE) > 0)
+   {
+      replay = fopen(CONFIG_LORA_SIM_REPLAY_FILE, "rb");
+      if (replay == NULL)
+         ESP_LOGE(TAG, "Can not open %s, sending synthetic packets", CONFIG_LORA_SIM_REPLAY_FILE);
+      else
+         gap = lora_sim_replay(replay, &packet);
+      due += gap;
+   }
+
+   while (1)
+   {
+      /*
+       * Sends every packet which became due since the last tick,
+       * rates above the tick rate put several packets on the air at once.
+       */
+      int64_t now = lora_sim_time();
+      while (due <= now)
+      {
+         if (replay != NULL)
+         {
+            if (gap < 0)
+               break;
+            packet.time = due;
+            lora_sim_transmit(&packet);
+            gap = lora_sim_replay(replay, &packet);
+            if (gap < 0)
+               ESP_LOGI(TAG, "Replay finished after %" PRIu32 " packets", __stats.generated);
+            due += gap;
+         }
+         else
+         {
+            lora_sim_synthesize(&packet);
+            packet.time = due;
+            lora_sim_transmit(&packet);
+            due += interval;
+         }
+      }
+
+      /*
+       * Packets whose preamble ended unheard are lost
+       */
+      portENTER_CRITICAL(&__fifo_lock);
+      for (int sf = 0; sf <= LORA_SIM_SF_MAX; sf++)
+      {
+         if (__parked_valid[sf] && __parked_until[sf] < now)
+         {
+            __parked_valid[sf] = 0;
+            __stats.missed++;
+         }
+      }
+      portEXIT_CRITICAL(&__fifo_lock);
+
+      /*
+       * Stands in for the DIO0 TxDone and CadDone interrupts
+       */
+      if (__tx_busy && __tx_end <= now && __irq_task != NULL)
+         xTaskNotifyGive(__irq_task);
+      if (__mode == LORA_SIM_MODE_CAD && __cad_end <= now && __irq_task != NULL)
+         xTaskNotifyGive(__irq_task);
+
+      vTaskDelay(1);
+   }
+}
+
+/**
+ * Link quality of a node, fixed per node so the backend analytics see stable links.
+ */
+static void lora_sim_link_quality(uint32_t node_id, lora_packet_meta_t *meta)
+{
+   meta->rssi = -60 - (node_id % 70);
+   meta->snr = 40 - (node_id % 60);
+   meta->freq_error = ((int32_t)(node_id % 201) - 100) * 25;
+}
+
+void lora_reset(void)
+{
+}
+
+void lora_explicit_header_mode(void)
+{
+   __profile.implicit_header = 0;
+}
+
+void lora_implicit_header_mode(int size)
+{
+   __profile.implicit_header = size;
+}
+
+void lora_idle(void)
+{
+   __mode = LORA_SIM_MODE_IDLE;
+}
+
+void lora_sleep(void)
+{
+}
+
+/**
+ * Listen on the current spreading factor. A packet on it whose
+ * preamble is still on the air is received.
+ */
+void lora_receive(void)
+{
+   int sf = __profile.spreading_factor;
+   int delivered = 0;
+
+   portENTER_CRITICAL(&__fifo_lock);
+   __mode = LORA_SIM_MODE_RX;
+   if (sf >= 0 && sf <= LORA_SIM_SF_MAX && __parked_valid[sf] && __parked_until[sf] >= lora_sim_time())
+   {
+      if (lora_sim_deliver(&__parked[sf]))
+         __stats.overruns++;
+      else
+         delivered = 1;
+      __parked_valid[sf] = 0;
+   }
+   portEXIT_CRITICAL(&__fifo_lock);
+
+   if (delivered && __irq_task != NULL)
+      xTaskNotifyGive(__irq_task);
+}
+
+void lora_set_tx_power(int level)
+{
+}
+
+void lora_set_frequency(long frequency)
+{
+   __profile.frequency = frequency;
+}
+
+void lora_set_spreading_factor(int sf)
+{
+   __profile.spreading_factor = sf;
+}
+
+void lora_set_bandwidth(long sbw)
+{
+   /*
+    * Wider bandwidths end up on the widest setting like on the real radio
+    */
+   __profile.bandwidth = sbw < 500000 ? sbw : 500000;
+}
+
+void lora_set_coding_rate(int denominator)
+{
+   __profile.coding_rate = denominator;
+}
+
+void lora_set_preamble_length(long length)
+{
+   __profile.preamble_length = length;
+}
+
+void lora_set_sync_word(int sw)
+{
+}
+
+void lora_enable_crc(void)
+{
+   __profile.crc = 1;
+}
+
+void lora_disable_crc(void)
+{
+   __profile.crc = 0;
+}
+
+void lora_apply_profile(const lora_modem_profile_t *profile)
+{
+   __profile = *profile;
+   lora_set_bandwidth(profile->bandwidth);
+   __mode = LORA_SIM_MODE_IDLE;
+}
+
+void lora_get_profile(lora_modem_profile_t *profile)
+{
+   *profile = __profile;
+}
+
+/**
+ * Start putting packets on the air.
+ */
+int lora_init(void)
+{
+   if (__initialized)
+      return 1;
+
+   /*
+    * Spreading factors of the nodes
+    */
+   const char *list = CONFIG_LORA_SIM_NODE_SPREADING_FACTORS;
+   while (*list != '\0' && __node_sf_count < LORA_SIM_SF_MAX)
+   {
+      char *end;
+      long sf = strtol(list, &end, 10);
+      if (end == list)
+         break;
+      if (sf >= 6 && sf <= LORA_SIM_SF_MAX)
+         __node_sf[__node_sf_count++] = sf;
+      list = *end == ',' ? end + 1 : end;
+   }
+
+   if (xTaskCreate(&lora_sim_task, "lora_sim", 4096, NULL, configMAX_PRIORITIES - 1, NULL) != pdPASS)
+      return 0;
+
+   __initialized = 1;
+   ESP_LOGI(TAG, "Simulating %d nodes at %d packets/s, %d%% duplicates",
+            CONFIG_LORA_SIM_NODE_COUNT, CONFIG_LORA_SIM_PACKET_RATE, CONFIG_LORA_SIM_DUPLICATE_PERCENT);
+   return 1;
+}
+
+/**
+ * Transmitted packets are dropped.
+ */
+void lora_send_packet(uint8_t *buf, int size)
+{
+}
+
+/**
+ * Occupies the air for the time on air of the packet, which is dropped.
+ */
+int lora_send_packet_async(const uint8_t *buf, int size, lora_tx_done_cb_t done, void *arg)
+{
+   if (__tx_busy)
+      return 0;
+
+   __tx_done = done;
+   __tx_arg = arg;
+   __tx_end = lora_sim_time() + lora_time_on_air_us(&__profile, size);
+   __tx_busy = 1;
+   __stats.sent++;
+   return 1;
+}
+
+int lora_tx_busy(void)
+{
+   return __tx_busy;
+}
+
+void lora_tx_poll(void)
+{
+   if (!__tx_busy || lora_sim_time() < __tx_end)
+      return;
+
+   __tx_busy = 0;
+   lora_receive();
+   if (__tx_done != NULL)
+      __tx_done(1, __tx_arg);
+}
+
+/**
+ * Detects a packet whose preamble is on the air on the current
+ * spreading factor, after two symbols like the real radio.
+ */
+void lora_cad_start(void)
+{
+   int64_t symbol_us = lora_sim_symbol_us(__profile.spreading_factor);
+
+   __cad_start = lora_sim_time();
+   __cad_end = __cad_start + 2 * symbol_us;
+   __mode = LORA_SIM_MODE_CAD;
+}
+
+int lora_cad_poll(void)
+{
+   int sf = __profile.spreading_factor;
+   int detected;
+
+   if (__mode != LORA_SIM_MODE_CAD)
+      return 0;
+   if (lora_sim_time() < __cad_end)
+      return -1;
+
+   portENTER_CRITICAL(&__fifo_lock);
+   detected = sf >= 0 && sf <= LORA_SIM_SF_MAX && __parked_valid[sf] && __parked_until[sf] >= __cad_start;
+   __mode = LORA_SIM_MODE_IDLE;
+   portEXIT_CRITICAL(&__fifo_lock);
+   return detected;
+}
+
+void lora_cad_stop(void)
+{
+   portENTER_CRITICAL(&__fifo_lock);
+   if (__mode == LORA_SIM_MODE_CAD)
+      __mode = LORA_SIM_MODE_IDLE;
+   portEXIT_CRITICAL(&__fifo_lock);
+}
+
+/**
+ * Packets arrive whole, the modem is never caught in the middle of one.
+ */
+int lora_rx_in_progress(void)
+{
+   return 0;
+}
+
+/**
+ * Read the oldest packet of the FIFO.
+ * @param buf Buffer for the data, NULL to drop the packet.
+ * @param size Available size in buffer (bytes).
+ * @return Number of bytes received (zero if no packet available).
+ */
+int lora_receive_packet(uint8_t *buf, int size)
+{
+   int len = 0;
+
+   portENTER_CRITICAL(&__fifo_lock);
+   if (__fifo_count > 0)
+   {
+      lora_sim_packet_t *packet = &__fifo[__fifo_head];
+      len = packet->size > size ? size : packet->size;
+      if (len > 0)
+         memcpy(buf, packet->data, len);
+      __irq_time = packet->time;
+      if (packet->size >= 4)
+         lora_sim_link_quality(lora_sim_read_u32(packet->data), &__meta);
+      __fifo_head = (__fifo_head + 1) % CONFIG_LORA_SIM_FIFO_DEPTH;
+      __fifo_count--;
+   }
+   portEXIT_CRITICAL(&__fifo_lock);
+
+   if (len > 0)
+      __stats.received++;
+   return len;
+}
+
+int lora_received(void)
+{
+   return __fifo_count > 0;
+}
+
+int lora_packet_rssi(void)
+{
+   return __meta.rssi;
+}
+
+float lora_packet_snr(void)
+{
+   return __meta.snr * 0.25;
+}
+
+long lora_packet_freq_error(void)
+{
+   return __meta.freq_error;
+}
+
+void lora_read_packet_meta(lora_packet_meta_t *meta)
+{
+   *meta = __meta;
+}
+
+void lora_close(void)
+{
+}
+
+int lora_initialized(void)
+{
+   return __initialized;
+}
+
+void lora_dump_registers(void)
+{
+}
+
+/**
+ * The generator notifies the task for every packet put into the FIFO.
+ */
+int lora_enable_rx_interrupt(TaskHandle_t task)
+{
+   __irq_task = task;
+   return 1;
+}
+
+void lora_disable_rx_interrupt(void)
+{
+   __irq_task = NULL;
+}
+
+/**
+ * Return the time the last read packet was put on the air.
+ */
+int64_t lora_last_irq_time(void)
+{
+   int64_t time;
+
+   portENTER_CRITICAL(&__fifo_lock);
+   time = __irq_time;
+   portEXIT_CRITICAL(&__fifo_lock);
+   return time;
+}
+
+void lora_write_fifo(const uint8_t *buf, int size)
+{
+}
+
+void lora_read_fifo(uint8_t *buf, int size)
+{
+   memset(buf, 0, size);
+}
+
+void lora_get_spi_stats(lora_spi_stats_t *stats)
+{
+   memset(stats, 0, sizeof(*stats));
+}
+
+void lora_reset_spi_stats(void)
+{
+}
+
+void lora_benchmark_fifo(int size, int iterations)
+{
+   ESP_LOGW(TAG, "FIFO benchmark needs the real radio");
+}
+
+/**
+ * Return the counters of the simulated air interface.
+ */
+void lora_sim_get_stats(lora_sim_stats_t *stats)
+{
+   *stats = __stats;
+}
+
+/**
+ * Look up when a packet was first put on the air.
+ * Safe to call from threads outside of FreeRTOS.
+ * @return Time from lora_sim_time(), negative if the packet is not remembered.
+ */
+int64_t lora_sim_sent_time(uint32_t node_id, uint32_t message_id)
+{
+   int64_t time = -1;
+
+   pthread_mutex_lock(&__sent_lock);
+   lora_sim_sent_t *entry = lora_sim_sent_entry(node_id, message_id);
+   if (entry->time != 0 && entry->node_id == node_id && entry->message_id == message_id)
+      time = entry->time;
+   pthread_mutex_unlock(&__sent_lock);
+
+   return time;
+}
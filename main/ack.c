@@ -0,0 +1,159 @@
+#include "ack.h"
+#include <string.h>
+#include "esp_timer.h"
+#include "metrics.h"
+#include "rx_scheduler.h"
+
+// The whole scheduler is left out without LORA_ACK
+#if CONFIG_LORA_ACK
+
+// An ack waiting for the next downlink frame, with the receive
+// profile its packet came in on and when it was received
+typedef struct
+{
+    lora_header_t header;
+    uint8_t profile;
+    int64_t rx_us;
+} ack_pending_t;
+
+// Acks waiting for the next downlink frame, oldest first. Only
+// the radio receive task touches the scheduler, so nothing is locked
+static ack_pending_t s_ack_pending[CONFIG_LORA_ACK_MAX_PAIRS];
+static int s_ack_count;
+// Reception time of the oldest pending ack
+static int64_t s_ack_first_us;
+
+// The frame on the air, the radio copies it into its FIFO
+// when the transmission starts
+static uint8_t s_ack_frame[ACK_FRAME_MAX_SIZE];
+static int s_ack_frame_acks;
+static int64_t s_ack_tx_start_us;
+
+static ack_stats_t s_ack_stats;
+
+// Coalescing window in microseconds
+#define ACK_COALESCE_US ((int64_t)CONFIG_LORA_ACK_COALESCE_MS * 1000)
+
+// How soon a frame held back by an incoming packet is tried again,
+// the RxDone of the packet usually wakes the task before that
+#define ACK_RX_RETRY_MS 10
+
+esp_err_t ack_init(void) {
+    s_ack_count = 0;
+    memset(&s_ack_stats, 0, sizeof(s_ack_stats));
+
+    return ESP_OK;
+}
+
+// Queues an ack for a packet received on the given
+// profile of the receive scheduler
+void ack_schedule(lora_header_t header, int profile, int64_t now_us) {
+    s_ack_stats.scheduled++;
+
+    for (int i = 0; i < s_ack_count; i++) {
+        if (s_ack_pending[i].header.node_id == header.node_id && s_ack_pending[i].header.message_id == header.message_id) {
+            s_ack_stats.coalesced++;
+            return;
+        }
+    }
+
+    // The sender retransmits and gets its ack with a later frame
+    if (s_ack_count == CONFIG_LORA_ACK_MAX_PAIRS) {
+        s_ack_stats.dropped++;
+        metrics_count(METRIC_ACK_DROPPED);
+        return;
+    }
+
+    if (s_ack_count == 0) {
+        s_ack_first_us = now_us;
+    }
+    s_ack_pending[s_ack_count++] = (ack_pending_t){.header = header, .profile = profile, .rx_us = now_us};
+}
+
+static void ack_put_u32(uint8_t *out, uint32_t value) {
+    out[0] = (uint8_t)(value & 0xff);
+    out[1] = (uint8_t)((value >> 8) & 0xff);
+    out[2] = (uint8_t)((value >> 16) & 0xff);
+    out[3] = (uint8_t)(value >> 24);
+}
+
+// Runs in the receive task from lora_tx_poll(),
+// the radio is already back in continuous receive
+static void ack_tx_done(int success, void *arg) {
+    int64_t now_us = esp_timer_get_time();
+
+    s_ack_stats.airtime_us += now_us - s_ack_tx_start_us;
+    if (success) {
+        s_ack_stats.frames++;
+        s_ack_stats.acks += s_ack_frame_acks;
+        metrics_count(METRIC_ACK_FRAMES);
+        metrics_add(METRIC_ACKS_SENT, s_ack_frame_acks);
+    } else {
+        s_ack_stats.failures++;
+    }
+}
+
+// Sends the pending acks once the frame is full or the oldest
+// one waited for the coalescing window. Returns how long until
+// the pending acks are due, portMAX_DELAY when there are none
+TickType_t ack_poll(int64_t now_us) {
+    if (s_ack_count == 0) {
+        return portMAX_DELAY;
+    }
+
+    int64_t due_us = s_ack_first_us + ACK_COALESCE_US;
+    if (s_ack_count < CONFIG_LORA_ACK_MAX_PAIRS && now_us < due_us) {
+        // At least a tick, so the task does not spin until then
+        TickType_t wait = pdMS_TO_TICKS((due_us - now_us + 999) / 1000);
+        return wait > 0 ? wait : 1;
+    }
+
+    // The previous frame is still on the air, its TxDone wakes the task
+    if (lora_tx_busy()) {
+        return portMAX_DELAY;
+    }
+
+    // Transmitting now would destroy the packet the modem is
+    // locked on, or the one waiting in the FIFO
+    if (lora_rx_in_progress() || lora_received()) {
+        s_ack_stats.deferred++;
+        TickType_t wait = pdMS_TO_TICKS(ACK_RX_RETRY_MS);
+        return wait > 0 ? wait : 1;
+    }
+
+    // A node only hears the spreading factor it sent on, so every
+    // frame carries the acks of one profile, starting with the
+    // profile of the oldest ack. The others follow in later frames
+    uint8_t profile = s_ack_pending[0].profile;
+    int acks = 0;
+    int kept = 0;
+    for (int i = 0; i < s_ack_count; i++) {
+        if (s_ack_pending[i].profile == profile) {
+            uint8_t *entry = s_ack_frame + ACK_FRAME_HEADER_SIZE + acks * ACK_ENTRY_SIZE;
+            ack_put_u32(entry, s_ack_pending[i].header.node_id);
+            ack_put_u32(entry + 4, s_ack_pending[i].header.message_id);
+            acks++;
+        } else {
+            s_ack_pending[kept++] = s_ack_pending[i];
+        }
+    }
+    s_ack_frame[0] = ACK_FRAME_TYPE;
+    s_ack_frame[1] = acks;
+    s_ack_count = kept;
+    if (kept > 0) {
+        s_ack_first_us = s_ack_pending[0].rx_us;
+    }
+
+    s_ack_frame_acks = acks;
+    s_ack_tx_start_us = now_us;
+    rx_scheduler_tx_profile(profile);
+    lora_send_packet_async(s_ack_frame, ACK_FRAME_HEADER_SIZE + acks * ACK_ENTRY_SIZE, ack_tx_done, NULL);
+
+    // The acks of other profiles are due as soon as this frame is out
+    return portMAX_DELAY;
+}
+
+void ack_get_stats(ack_stats_t *stats) {
+    *stats = s_ack_stats;
+}
+#endif
@@ -0,0 +1,380 @@
+// strcasestr() for the header lookup
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+#include <inttypes.h>
+#include <pthread.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#include "esp_log.h"
+#include "freertos/FreeRTOS.h"
+#include "freertos/task.h"
+#include "sx1278_sim.h"
+#include "packet_pool.h"
+#include "dedup.h"
+#include "rx_filter.h"
+#include "ack.h"
+#include "rx_scheduler.h"
+#include "uplink_batch.h"
+#include "uplink.h"
+#include "uplink_codec.h"
+#include "metrics.h"
+#include "bench.h"
+
+// Log tag
+static const char *TAG = "BENCH";
+
+// Room for the request line and headers of a request
+#define BENCH_HEADER_SIZE 1024
+
+// Reply of the sink to every request, followed
+// by a reply body without configuration
+static const char BENCH_REPLY[] = "HTTP/1.1 200 OK\r\nContent-Length: 10\r\n\r\n";
+
+// The ingest queue of the receive pipeline, only read for the report
+static ingest_queue_t *s_bench_queue;
+
+// Counters of the sink, written by the connection threads
+static bench_sink_stats_t s_bench_stats;
+
+// End-to-end latencies of the packets delivered since the last report,
+// per ingest lane
+static uint32_t s_bench_latency[INGEST_LANE_COUNT][CONFIG_BENCH_LATENCY_SAMPLES];
+static uint32_t s_bench_latency_count[INGEST_LANE_COUNT];
+static pthread_mutex_t s_bench_lock = PTHREAD_MUTEX_INITIALIZER;
+
+// One connection of the uplink.
+// Every connection gets its own thread and buffer so
+// parallel uplinks are not serialized by the sink
+typedef struct
+{
+    int socket;
+    size_t length;
+    char buffer[BENCH_HEADER_SIZE + UPLINK_BATCH_BUFFER_SIZE];
+    // The batch of a compressed request
+    uplink_batch_t decoded;
+} bench_connection_t;
+
+static uint32_t bench_read_u32(const uint8_t *buf) {
+    return buf[0] | (buf[1] << 8) | (buf[2] << 16) | ((uint32_t)buf[3] << 24);
+}
+
+// Accounts every frame of a received batch
+static void bench_sink_batch(const uint8_t *body, size_t length, int64_t now) {
+    static uplink_batch_t batch;
+    const uint8_t *frame;
+    size_t offset = 0;
+    size_t size;
+
+    pthread_mutex_lock(&s_bench_lock);
+    s_bench_stats.requests++;
+
+    if (length < UPLINK_BATCH_HEADER_SIZE || length > sizeof(batch.body)) {
+        s_bench_stats.malformed++;
+        pthread_mutex_unlock(&s_bench_lock);
+        return;
+    }
+
+    memcpy(batch.body, body, length);
+    batch.length = length;
+    batch.count = body[1];
+
+    // The payload follows the radio metadata from framing version 2 on
+    size_t envelope = uplink_batch_envelope_size(body[0]);
+
+    while (uplink_batch_next_frame(&batch, &offset, &frame, &size)) {
+        s_bench_stats.frames++;
+        if (size < envelope + sizeof(lora_header_t)) {
+            s_bench_stats.malformed++;
+            continue;
+        }
+        frame += envelope;
+
+        lora_header_t header = {
+            .node_id = bench_read_u32(frame),
+            .message_id = bench_read_u32(frame + 4),
+        };
+        int64_t sent = lora_sim_sent_time(header.node_id, header.message_id);
+        if (sent < 0) {
+            s_bench_stats.unmatched++;
+            continue;
+        }
+
+        // Keeps the first samples of the interval once the buffer is full
+        ingest_lane_t lane = rx_filter_lane(&header);
+        if (s_bench_latency_count[lane] < CONFIG_BENCH_LATENCY_SAMPLES) {
+            s_bench_latency[lane][s_bench_latency_count[lane]++] = (uint32_t)(now - sent);
+        }
+    }
+
+    pthread_mutex_unlock(&s_bench_lock);
+}
+
+// Serves the requests of one connection until the client closes it
+static void *bench_connection_thread(void *arg) {
+    bench_connection_t *connection = arg;
+
+    while (1) {
+        // Reads until the end of the headers
+        char *end = NULL;
+        while ((end = strstr(connection->buffer, "\r\n\r\n")) == NULL) {
+            size_t room = BENCH_HEADER_SIZE - 1 - connection->length;
+            ssize_t received = room > 0 ? recv(connection->socket, connection->buffer + connection->length, room, 0) : -1;
+            if (received <= 0) {
+                goto done;
+            }
+            connection->length += received;
+            connection->buffer[connection->length] = '\0';
+        }
+
+        size_t header_length = end + 4 - connection->buffer;
+        size_t content_length = 0;
+        char *field = strcasestr(connection->buffer, "\r\nContent-Length:");
+        if (field != NULL && field < end) {
+            content_length = strtoul(field + strlen("\r\nContent-Length:"), NULL, 10);
+        }
+        char *close_field = strcasestr(connection->buffer, "\r\nConnection: close");
+        bool close_after = close_field != NULL && close_field < end;
+        char *encoding_field = strcasestr(connection->buffer, "\r\nContent-Encoding: " UPLINK_CODEC_ENCODING);
+        bool compressed = encoding_field != NULL && encoding_field < end;
+
+        if (header_length + content_length > sizeof(connection->buffer) - 1) {
+            ESP_LOGE(TAG, "Request of %zu bytes does not fit", content_length);
+            goto done;
+        }
+
+        // Reads the rest of the body
+        while (connection->length < header_length + content_length) {
+            ssize_t received = recv(connection->socket, connection->buffer + connection->length,
+                                    header_length + content_length - connection->length, 0);
+            if (received <= 0) {
+                goto done;
+            }
+            connection->length += received;
+        }
+
+        if (strncmp(connection->buffer, "POST /api/heartbeat", strlen("POST /api/heartbeat")) == 0) {
+            pthread_mutex_lock(&s_bench_lock);
+            s_bench_stats.heartbeats++;
+            pthread_mutex_unlock(&s_bench_lock);
+        } else if (compressed) {
+            const uint8_t *body = (const uint8_t *)connection->buffer + header_length;
+            if (uplink_codec_decode(body, content_length, &connection->decoded)) {
+                bench_sink_batch(connection->decoded.body, connection->decoded.length, lora_sim_time());
+            } else {
+                pthread_mutex_lock(&s_bench_lock);
+                s_bench_stats.requests++;
+                s_bench_stats.malformed++;
+                pthread_mutex_unlock(&s_bench_lock);
+            }
+        } else {
+            bench_sink_batch((const uint8_t *)connection->buffer + header_length, content_length, lora_sim_time());
+        }
+        // Acknowledges with the number of requests seen so far
+        uint8_t body[UPLINK_REPLY_HEADER_SIZE] = {UPLINK_REPLY_VERSION, 0};
+        uint32_t ack = s_bench_stats.requests + s_bench_stats.heartbeats;
+        for (int i = 0; i < 4; i++) {
+            body[2 + i] = (ack >> (8 * i)) & 0xff;
+        }
+        send(connection->socket, BENCH_REPLY, sizeof(BENCH_REPLY) - 1, MSG_MORE);
+        send(connection->socket, body, sizeof(body), 0);
+
+        // Keeps what was already read of the next request
+        size_t consumed = header_length + content_length;
+        connection->length -= consumed;
+        memmove(connection->buffer, connection->buffer + consumed, connection->length);
+        connection->buffer[connection->length] = '\0';
+
+        if (close_after) {
+            break;
+        }
+    }
+
+done:
+    close(connection->socket);
+    free(connection);
+    return NULL;
+}
+
+// Accepts the connections of the uplink
+static void *bench_sink_thread(void *arg) {
+    int listener = (int)(intptr_t)arg;
+
+    while (1) {
+        int client = accept(listener, NULL, NULL);
+        if (client < 0) {
+            continue;
+        }
+
+        bench_connection_t *connection = calloc(1, sizeof(bench_connection_t));
+        pthread_t thread;
+        if (connection == NULL) {
+            close(client);
+            continue;
+        }
+        connection->socket = client;
+
+        if (pthread_create(&thread, NULL, bench_connection_thread, connection) != 0) {
+            close(client);
+            free(connection);
+            continue;
+        }
+        pthread_detach(thread);
+    }
+
+    return NULL;
+}
+
+static int bench_compare_u32(const void *a, const void *b) {
+    uint32_t x = *(const uint32_t *)a;
+    uint32_t y = *(const uint32_t *)b;
+    return (x > y) - (x < y);
+}
+
+// Logs the nearest rank percentiles of the latencies of a lane
+static void bench_report_latency(const char *lane, uint32_t *samples, uint32_t count) {
+    if (count == 0) {
+        return;
+    }
+
+    qsort(samples, count, sizeof(uint32_t), bench_compare_u32);
+    ESP_LOGI(TAG, "%s latency ms: p50 %.1f, p90 %.1f, p99 %.1f, max %.1f (%" PRIu32 " samples)", lane,
+             samples[(count - 1) * 50 / 100] / 1000.0f, samples[(count - 1) * 90 / 100] / 1000.0f,
+             samples[(count - 1) * 99 / 100] / 1000.0f, samples[count - 1] / 1000.0f, count);
+}
+
+// Logs the throughput, the drops of every pipeline stage
+// and the latency percentiles of the last interval
+static void bench_report_task(void *pvParameters) {
+    static uint32_t samples[INGEST_LANE_COUNT][CONFIG_BENCH_LATENCY_SAMPLES];
+    uint32_t last_frames = 0;
+    int64_t last_time = lora_sim_time();
+
+    while (1) {
+        vTaskDelay(pdMS_TO_TICKS(CONFIG_BENCH_REPORT_INTERVAL_SEC * 1000));
+
+        bench_sink_stats_t sink;
+        uint32_t count[INGEST_LANE_COUNT];
+        pthread_mutex_lock(&s_bench_lock);
+        sink = s_bench_stats;
+        for (int lane = 0; lane < INGEST_LANE_COUNT; lane++) {
+            count[lane] = s_bench_latency_count[lane];
+            memcpy(samples[lane], s_bench_latency[lane], count[lane] * sizeof(uint32_t));
+            s_bench_latency_count[lane] = 0;
+        }
+        pthread_mutex_unlock(&s_bench_lock);
+
+        lora_sim_stats_t air;
+        packet_pool_stats_t pool;
+        dedup_stats_t dedup;
+        ingest_stats_t ingest;
+        ingest_stats_t priority;
+        lora_sim_get_stats(&air);
+        packet_pool_get_stats(&pool);
+        dedup_get_stats(&dedup);
+        ingest_get_stats(s_bench_queue, INGEST_LANE_BULK, &ingest);
+        ingest_get_stats(s_bench_queue, INGEST_LANE_PRIORITY, &priority);
+
+        int64_t now = lora_sim_time();
+        float rate = (sink.frames - last_frames) * 1e6f / (now - last_time);
+        last_frames = sink.frames;
+        last_time = now;
+
+        ESP_LOGI(TAG, "air %" PRIu32 " (dup %" PRIu32 ", overrun %" PRIu32 "), delivered %" PRIu32 " in %" PRIu32 " requests, %.1f pkt/s",
+                 air.generated, air.duplicates, air.overruns, sink.frames, sink.requests, rate);
+        ESP_LOGI(TAG, "drops: pool %" PRIu32 ", dedup %" PRIu32 ", ingest %" PRIu32 ", unmatched %" PRIu32 ", malformed %" PRIu32,
+                 pool.exhausted, dedup.hits,
+                 ingest.dropped_oldest + ingest.dropped_newest + ingest.dropped_fair +
+                 priority.dropped_oldest + priority.dropped_newest + priority.dropped_fair,
+                 sink.unmatched, sink.malformed);
+
+        rx_filter_stats_t filter;
+        rx_filter_get_stats(&filter);
+        ESP_LOGI(TAG, "rejected: short %" PRIu32 ", unknown node %" PRIu32 ", bad tag %" PRIu32,
+                 filter.frames[RX_FILTER_TOO_SHORT], filter.frames[RX_FILTER_UNKNOWN_NODE], filter.frames[RX_FILTER_BAD_TAG]);
+
+        // Workers near 100% are waiting on the backend the whole
+        // time, the pool is too small for its latency
+        metrics_snapshot_t metrics;
+        char busy[8 * CONFIG_UPLINK_WORKERS + 1];
+        size_t n = 0;
+        metrics_snapshot(&metrics);
+        for (int i = 0; i < CONFIG_UPLINK_WORKERS; i++) {
+            n += snprintf(busy + n, sizeof(busy) - n, " %" PRIu32 "%%", metrics.gauges[METRIC_GAUGE_UPLINK0_BUSY_PCT + i]);
+        }
+        ESP_LOGI(TAG, "uplink workers busy:%s", busy);
+
+        // Packets sent on a spreading factor the radio was not
+        // on while their preamble lasted never reach the FIFO
+        if (rx_scheduler_active()) {
+            ESP_LOGI(TAG, "missed on other spreading factors: %" PRIu32, air.missed);
+            rx_scheduler_report();
+        }
+
+#if CONFIG_LORA_ACK
+        // Packets lost to the ack frames are the price of stopping
+        // the retransmissions, compare them to the duplicates
+        ack_stats_t acks;
+        ack_get_stats(&acks);
+        ESP_LOGI(TAG, "acks: %" PRIu32 " in %" PRIu32 " frames, dropped %" PRIu32 ", deferred %" PRIu32 ", %" PRIu32 " ms on air, %" PRIu32 " packets missed meanwhile",
+                 acks.acks, acks.frames, acks.dropped, acks.deferred, (uint32_t)(acks.airtime_us / 1000), air.deaf);
+#endif
+
+#if CONFIG_UPLINK_COMPRESSION
+        uint32_t codec_in = metrics.counters[METRIC_CODEC_BYTES_IN];
+        uint32_t codec_out = metrics.counters[METRIC_CODEC_BYTES_OUT];
+        if (codec_out > 0) {
+            ESP_LOGI(TAG, "compression: %" PRIu32 " -> %" PRIu32 " bytes (ratio %.2f), %.1f us per KB",
+                     codec_in, codec_out, (float)codec_in / codec_out,
+                     metrics.counters[METRIC_CODEC_TIME_US] * 1024.0f / codec_in);
+        }
+#endif
+
+        // Priority packets should stay close to a single
+        // request however long the bulk lane takes
+        bench_report_latency("priority", samples[INGEST_LANE_PRIORITY], count[INGEST_LANE_PRIORITY]);
+        bench_report_latency("bulk", samples[INGEST_LANE_BULK], count[INGEST_LANE_BULK]);
+    }
+}
+
+esp_err_t bench_start(ingest_queue_t *queue) {
+    s_bench_queue = queue;
+
+    int listener = socket(AF_INET, SOCK_STREAM, 0);
+    if (listener < 0) {
+        return ESP_FAIL;
+    }
+
+    int reuse = 1;
+    setsockopt(listener, SOL_SOCKET, SO_REUSEADDR, &reuse, sizeof(reuse));
+
+    struct sockaddr_in address = {
+        .sin_family = AF_INET,
+        .sin_port = htons(CONFIG_BENCH_SINK_PORT),
+        .sin_addr.s_addr = htonl(INADDR_LOOPBACK),
+    };
+    if (bind(listener, (struct sockaddr *)&address, sizeof(address)) != 0 || listen(listener, 4) != 0) {
+        ESP_LOGE(TAG, "Can not listen on port %d", CONFIG_BENCH_SINK_PORT);
+        close(listener);
+        return ESP_FAIL;
+    }
+
+    // The sink runs on host threads outside of the
+    // FreeRTOS scheduler, like a server on another machine
+    pthread_t thread;
+    if (pthread_create(&thread, NULL, bench_sink_thread, (void *)(intptr_t)listener) != 0) {
+        close(listener);
+        return ESP_FAIL;
+    }
+    pthread_detach(thread);
+
+    if (xTaskCreate(&bench_report_task, "bench_report_task", 4096, NULL, 1, NULL) != pdPASS) {
+        return ESP_FAIL;
+    }
+
+    ESP_LOGI(TAG, "Sink listening on http://127.0.0.1:%d", CONFIG_BENCH_SINK_PORT);
+    return ESP_OK;
+}
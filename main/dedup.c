@@ -0,0 +1,222 @@
+#include "dedup.h"
+#include <string.h>
+#include "esp_attr.h"
+#include "esp_log.h"
+#include "esp_timer.h"
+#include "freertos/FreeRTOS.h"
+
+static const char *TAG = "DEDUP";
+
+// Longest probe sequence. Bounds the work done for
+// every packet no matter how full the table is
+#define DEDUP_MAX_PROBE 8
+
+// Deduplication window in milliseconds
+#define DEDUP_WINDOW_MS ((uint32_t)CONFIG_DEDUP_WINDOW_SEC * 1000)
+
+// Table entry, a zero timestamp marks an empty slot
+typedef struct
+{
+    uint32_t node_id;
+    uint32_t message_id;
+    uint32_t seen_ms;
+} dedup_entry_t;
+
+// Marks a table written by this firmware, the rest of
+// RTC memory holds garbage after a power on
+#define DEDUP_TABLE_MAGIC 0x64647570
+
+// Open addressed hash table of recently seen packet headers
+typedef struct
+{
+    uint32_t magic;
+    uint32_t capacity;
+    // Clock of the last insert or dedup_tick(). The clock
+    // of the next boot continues from it, so the entries keep
+    // their age give or take the tick interval and the reboot.
+    // Not covered by the checksum, a single word write
+    uint32_t clock_ms;
+    // XOR of the checksums of every entry, kept up to date
+    // with every insert. A reset in the middle of an insert
+    // leaves it wrong and the table is not restored
+    uint32_t checksum;
+    dedup_entry_t entries[CONFIG_DEDUP_CAPACITY];
+} dedup_table_t;
+
+// In RTC memory the table survives watchdog resets, panics
+// and brownouts, so the duplicates the relays retransmit
+// right after a restart are still recognized
+#if CONFIG_DEDUP_PERSIST
+_Static_assert(sizeof(dedup_table_t) <= 12 * 1024, "dedup table too large for RTC memory, reduce DEDUP_CAPACITY");
+static RTC_NOINIT_ATTR dedup_table_t s_dedup_table;
+#else
+static dedup_table_t s_dedup_table;
+#endif
+
+// Added to the esp_timer milliseconds, continues the clock
+// of the restored table
+static uint32_t s_dedup_epoch_ms;
+
+static dedup_stats_t s_dedup_stats;
+static portMUX_TYPE s_dedup_lock = portMUX_INITIALIZER_UNLOCKED;
+
+// Checksum of the entry in the given slot, empty slots count as 0
+static uint32_t dedup_entry_checksum(uint32_t index, const dedup_entry_t *entry) {
+    if (entry->seen_ms == 0) {
+        return 0;
+    }
+
+    uint32_t h = entry->node_id * 0x9e3779b1u ^ entry->message_id * 0x85ebca6bu ^ entry->seen_ms * 0xc2b2ae35u ^ index;
+    h ^= h >> 16;
+    h *= 0x85ebca6bu;
+    h ^= h >> 13;
+    h *= 0xc2b2ae35u;
+    h ^= h >> 16;
+
+    return h;
+}
+
+// Counts the entries of a table left by the previous boot,
+// or returns -1 if there is none or it does not add up
+static int dedup_validate(const dedup_table_t *table) {
+    if (table->magic != DEDUP_TABLE_MAGIC || table->capacity != CONFIG_DEDUP_CAPACITY) {
+        return -1;
+    }
+
+    uint32_t checksum = 0;
+    int entries = 0;
+    for (uint32_t i = 0; i < CONFIG_DEDUP_CAPACITY; i++) {
+        checksum ^= dedup_entry_checksum(i, &table->entries[i]);
+        entries += table->entries[i].seen_ms != 0;
+    }
+
+    return checksum == table->checksum ? entries : -1;
+}
+
+esp_err_t dedup_init(void) {
+    memset(&s_dedup_stats, 0, sizeof(s_dedup_stats));
+
+    // One pass over the table, microseconds even for the
+    // largest one, so the restore does not hold up the boot
+    int restored = dedup_validate(&s_dedup_table);
+    if (restored >= 0) {
+        s_dedup_epoch_ms = s_dedup_table.clock_ms - (uint32_t)(esp_timer_get_time() / 1000);
+        s_dedup_stats.restored = restored;
+        ESP_LOGI(TAG, "Restored %d entries", restored);
+        return ESP_OK;
+    }
+
+    memset(&s_dedup_table, 0, sizeof(s_dedup_table));
+    s_dedup_table.magic = DEDUP_TABLE_MAGIC;
+    s_dedup_table.capacity = CONFIG_DEDUP_CAPACITY;
+    s_dedup_epoch_ms = 0;
+
+    return ESP_OK;
+}
+
+// Mixes the node id and message id into a table index
+static uint32_t dedup_hash(lora_header_t header) {
+    uint32_t h = header.node_id * 0x9e3779b1u ^ header.message_id;
+
+    h ^= h >> 16;
+    h *= 0x85ebca6bu;
+    h ^= h >> 13;
+
+    return h % CONFIG_DEDUP_CAPACITY;
+}
+
+// Table clock at the given esp_timer time. Zero is reserved
+// for empty slots, the millisecond clock wraps after 49 days
+// which the unsigned subtractions below handle
+static uint32_t dedup_clock_ms(int64_t now_us) {
+    uint32_t now_ms = (uint32_t)(now_us / 1000) + s_dedup_epoch_ms;
+    return now_ms == 0 ? 1 : now_ms;
+}
+
+bool dedup_check_and_insert(lora_header_t header, int64_t now_us) {
+    uint32_t now_ms = dedup_clock_ms(now_us);
+
+    uint32_t index = dedup_hash(header);
+    dedup_entry_t *free_slot = NULL;
+    dedup_entry_t *oldest = NULL;
+    bool duplicate = false;
+
+    portENTER_CRITICAL(&s_dedup_lock);
+
+    for (int probe = 0; probe < DEDUP_MAX_PROBE; probe++) {
+        dedup_entry_t *entry = &s_dedup_table.entries[(index + probe) % CONFIG_DEDUP_CAPACITY];
+
+        // Slots are never emptied again, so an empty
+        // slot ends the probe sequence of every key
+        if (entry->seen_ms == 0) {
+            if (free_slot == NULL) {
+                free_slot = entry;
+            }
+            break;
+        }
+
+        bool expired = now_ms - entry->seen_ms >= DEDUP_WINDOW_MS;
+
+        if (entry->node_id == header.node_id && entry->message_id == header.message_id) {
+            // Seen within the window, refresh it so relays
+            // retransmitting the packet keep it known
+            duplicate = !expired;
+            free_slot = entry;
+            break;
+        }
+
+        if (expired && free_slot == NULL) {
+            free_slot = entry;
+        }
+
+        if (oldest == NULL || now_ms - entry->seen_ms > now_ms - oldest->seen_ms) {
+            oldest = entry;
+        }
+    }
+
+    if (duplicate) {
+        s_dedup_stats.hits++;
+    } else {
+        s_dedup_stats.misses++;
+
+        if (free_slot == NULL) {
+            // The whole probe sequence is live,
+            // the oldest entry makes room
+            free_slot = oldest;
+            s_dedup_stats.evictions++;
+        } else if (free_slot->seen_ms != 0) {
+            s_dedup_stats.expirations++;
+        }
+    }
+
+    uint32_t slot = free_slot - s_dedup_table.entries;
+    s_dedup_table.checksum ^= dedup_entry_checksum(slot, free_slot);
+    *free_slot = (dedup_entry_t){
+        .node_id = header.node_id,
+        .message_id = header.message_id,
+        .seen_ms = now_ms,
+    };
+    s_dedup_table.checksum ^= dedup_entry_checksum(slot, free_slot);
+    s_dedup_table.clock_ms = now_ms;
+
+    portEXIT_CRITICAL(&s_dedup_lock);
+
+    return duplicate;
+}
+
+// Moves the saved clock on while no packets come in, otherwise
+// a reset after a quiet hour would restore the clock of the last
+// insert and keep every entry an hour too young
+void dedup_tick(int64_t now_us) {
+    uint32_t now_ms = dedup_clock_ms(now_us);
+
+    portENTER_CRITICAL(&s_dedup_lock);
+    s_dedup_table.clock_ms = now_ms;
+    portEXIT_CRITICAL(&s_dedup_lock);
+}
+
+void dedup_get_stats(dedup_stats_t *stats) {
+    portENTER_CRITICAL(&s_dedup_lock);
+    *stats = s_dedup_stats;
+    portEXIT_CRITICAL(&s_dedup_lock);
+}
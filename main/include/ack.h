@@ -0,0 +1,47 @@
+#ifndef _ACK_H_
+#define _ACK_H_
+
+#include "esp_err.h"
+#include <stdint.h>
+#include "freertos/FreeRTOS.h"
+#include "lora.h"
+
+// Downlink frame which acknowledges received packets, little endian:
+//   uint8_t  frame type
+//   uint8_t  ack count
+//   repeated ack count times:
+//     uint32_t node id
+//     uint32_t message id
+#define ACK_FRAME_TYPE 0xa1
+#define ACK_FRAME_HEADER_SIZE 2
+#define ACK_ENTRY_SIZE 8
+#define ACK_FRAME_MAX_SIZE (ACK_FRAME_HEADER_SIZE + CONFIG_LORA_ACK_MAX_PAIRS * ACK_ENTRY_SIZE)
+
+// Ack scheduler counters
+typedef struct
+{
+    // Packets which asked for an ack
+    uint32_t scheduled;
+    // Acks already pending for the same packet, a retransmission
+    // or a relayed copy which arrived before the ack went out
+    uint32_t coalesced;
+    // Acks dropped because the next frame was full
+    // while the previous one was still on the air
+    uint32_t dropped;
+    // Due frames held back because a packet was coming in
+    uint32_t deferred;
+    // Downlink frames sent, acks they carried and
+    // frames which did not report TxDone in time
+    uint32_t frames;
+    uint32_t acks;
+    uint32_t failures;
+    // Time the receiver spent transmitting and could not receive
+    int64_t airtime_us;
+} ack_stats_t;
+
+esp_err_t ack_init(void);
+void ack_schedule(lora_header_t header, int profile, int64_t now_us);
+TickType_t ack_poll(int64_t now_us);
+void ack_get_stats(ack_stats_t *stats);
+
+#endif
@@ -0,0 +1,28 @@
+#ifndef _BENCH_H_
+#define _BENCH_H_
+
+#include "esp_err.h"
+#include <stdint.h>
+#include "ingest.h"
+
+// Host benchmark of the receive pipeline (linux target only).
+// The simulated radio feeds the pipeline and a local
+// http sink stands in for the backend
+
+// Sink counters
+typedef struct
+{
+    // Requests and frames received from the uplink
+    uint32_t requests;
+    uint32_t frames;
+    // Metrics heartbeats, they carry no frames
+    uint32_t heartbeats;
+    // Frames which the simulated radio did not send or no longer remembers
+    uint32_t unmatched;
+    // Bodies or frames which could not be decoded
+    uint32_t malformed;
+} bench_sink_stats_t;
+
+esp_err_t bench_start(ingest_queue_t *queue);
+
+#endif
@@ -0,0 +1,30 @@
+#ifndef _DEDUP_H_
+#define _DEDUP_H_
+
+#include "esp_err.h"
+#include <stdbool.h>
+#include <stdint.h>
+#include "lora.h"
+
+// Deduplication counters
+typedef struct
+{
+    // Packets which were already seen within the window
+    uint32_t hits;
+    // Packets which were not seen before
+    uint32_t misses;
+    // Entries overwritten before their window ran out
+    // because every slot in their probe sequence was taken
+    uint32_t evictions;
+    // Slots reused after their window ran out
+    uint32_t expirations;
+    // Entries restored from RTC memory at boot
+    uint32_t restored;
+} dedup_stats_t;
+
+esp_err_t dedup_init(void);
+bool dedup_check_and_insert(lora_header_t header, int64_t now_us);
+void dedup_tick(int64_t now_us);
+void dedup_get_stats(dedup_stats_t *stats);
+
+#endif
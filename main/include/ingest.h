@@ -0,0 +1,93 @@
+#ifndef _INGEST_H_
+#define _INGEST_H_
+
+#include "esp_err.h"
+#include <stdbool.h>
+#include <stdint.h>
+#include "freertos/FreeRTOS.h"
+#include "freertos/event_groups.h"
+#include "packet_pool.h"
+
+// What happens to a packet which arrives while the queue is full
+typedef enum
+{
+    // Evicts the packet which has been waiting the longest
+    INGEST_OVERFLOW_DROP_OLDEST,
+    // Drops the packet which just arrived
+    INGEST_OVERFLOW_DROP_NEWEST,
+    // Evicts the oldest packet of the node with the most
+    // queued packets, so one chatty node can not starve the rest
+    INGEST_OVERFLOW_NODE_FAIR,
+} ingest_overflow_policy_t;
+
+// Queue entry, the node id is kept next to the slot
+// so the fairness policy does not have to touch the packet
+typedef struct
+{
+    packet_slot_t slot;
+    uint32_t node_id;
+} ingest_entry_t;
+
+// Ingest queue counters
+typedef struct
+{
+    uint32_t pushed;
+    uint32_t popped;
+    // Packets evicted by the drop-oldest policy
+    uint32_t dropped_oldest;
+    // Packets rejected by the drop-newest policy
+    uint32_t dropped_newest;
+    // Packets evicted or rejected by the per-node fairness policy
+    uint32_t dropped_fair;
+    uint16_t depth;
+    uint16_t high_water;
+} ingest_stats_t;
+
+// Lanes of the queue, popped in order of urgency
+typedef enum
+{
+    // Urgent packets such as alarms, they skip the batching
+    INGEST_LANE_PRIORITY,
+    // Everything else, collected into batches
+    INGEST_LANE_BULK,
+    INGEST_LANE_COUNT,
+} ingest_lane_t;
+
+// Bounded ring of packet slots of one lane
+typedef struct
+{
+    ingest_entry_t *ring;
+    uint16_t capacity;
+    uint16_t head;
+    uint16_t count;
+    ingest_stats_t stats;
+} ingest_ring_t;
+
+// Rings of packet slots between the radio and the uplink,
+// one per lane. Pushing never blocks, the overflow policy
+// decides which packet of the lane is dropped when its ring
+// is full. Both lanes wake the same consumers
+typedef struct
+{
+    ingest_ring_t lanes[INGEST_LANE_COUNT];
+    ingest_overflow_policy_t policy;
+    portMUX_TYPE lock;
+    // Number of consumers sharing the queue. Every node is
+    // served by one consumer, so its packets stay in order
+    uint8_t consumers;
+    // One bit per consumer, set when a packet for it is pushed
+    EventGroupHandle_t ready;
+    StaticEventGroup_t ready_buffer;
+} ingest_queue_t;
+
+// Most consumers one queue can wake up separately
+#define INGEST_MAX_CONSUMERS 8
+
+esp_err_t ingest_init(ingest_queue_t *queue, ingest_overflow_policy_t policy, uint8_t consumers);
+esp_err_t ingest_init_lane(ingest_queue_t *queue, ingest_lane_t lane, ingest_entry_t *storage, uint16_t capacity);
+bool ingest_push(ingest_queue_t *queue, ingest_lane_t lane, packet_slot_t slot, uint32_t node_id);
+bool ingest_pop(ingest_queue_t *queue, uint8_t consumer, uint8_t lanes, packet_slot_t *slot, ingest_lane_t *lane, TickType_t timeout);
+uint8_t ingest_consumer_of(const ingest_queue_t *queue, uint32_t node_id);
+void ingest_get_stats(ingest_queue_t *queue, ingest_lane_t lane, ingest_stats_t *stats);
+
+#endif
@@ -0,0 +1,121 @@
+#ifndef _METRICS_H_
+#define _METRICS_H_
+
+#include "esp_err.h"
+#include <stddef.h>
+#include <stdint.h>
+
+// Event counters
+typedef enum
+{
+    // Packets read from the radio
+    METRIC_RX_PACKETS,
+    // Packets which failed the CRC check
+    METRIC_RX_CRC_ERRORS,
+    // Packets dropped as duplicates
+    METRIC_RX_DUPLICATES,
+    // Packets dropped because the packet pool was empty
+    METRIC_RX_POOL_EXHAUSTED,
+    // Requests sent to the backend, frames they carried
+    // and attempts which failed, without a response
+    // or with a status outside 2xx
+    METRIC_UPLOAD_REQUESTS,
+    METRIC_UPLOAD_FRAMES,
+    METRIC_UPLOAD_FAILURES,
+    // Responses by http status class
+    METRIC_HTTP_2XX,
+    METRIC_HTTP_3XX,
+    METRIC_HTTP_4XX,
+    METRIC_HTTP_5XX,
+    // Batch bytes before and after compression and the time
+    // spent compressing. Batches which did not shrink count
+    // with their own size on both sides
+    METRIC_CODEC_BYTES_IN,
+    METRIC_CODEC_BYTES_OUT,
+    METRIC_CODEC_TIME_US,
+    // Downlink ack frames sent, the acks they carried and
+    // acks dropped because the next frame was already full
+    METRIC_ACK_FRAMES,
+    METRIC_ACKS_SENT,
+    METRIC_ACK_DROPPED,
+    // Frames rejected by the receive filter: too short for
+    // the header, from a node not on the allowlist and
+    // with a tag which does not match
+    METRIC_RX_REJECT_SHORT,
+    METRIC_RX_REJECT_NODE,
+    METRIC_RX_REJECT_TAG,
+    // Configurations sent by the backend which were
+    // applied and which failed the checks
+    METRIC_CONFIG_APPLIED,
+    METRIC_CONFIG_REJECTED,
+    // Frames dropped because the backend rejected their batch
+    METRIC_UPLOAD_DROPPED,
+    METRIC_COUNTER_COUNT,
+} metric_counter_t;
+
+// Last reported values
+typedef enum
+{
+    METRIC_GAUGE_QUEUE_DEPTH,
+    METRIC_GAUGE_POOL_IN_USE,
+    METRIC_GAUGE_SPOOL_RECORDS,
+    // Share of the last interval every uplink worker spent
+    // on a request, in percent. Unused workers stay at 0
+    METRIC_GAUGE_UPLINK0_BUSY_PCT,
+    METRIC_GAUGE_UPLINK1_BUSY_PCT,
+    METRIC_GAUGE_UPLINK2_BUSY_PCT,
+    METRIC_GAUGE_UPLINK3_BUSY_PCT,
+    // Version of the configuration in effect, 0 for the defaults
+    METRIC_GAUGE_CONFIG_VERSION,
+    METRIC_GAUGE_COUNT,
+} metric_gauge_t;
+
+// Latency histograms, in milliseconds
+typedef enum
+{
+    // From the start of a request until the response
+    METRIC_HIST_UPLOAD_MS,
+    // From the reception of the first packet of a batch until
+    // the backend acknowledged the batch
+    METRIC_HIST_DELIVERY_MS,
+    // The same for the packets of the priority lane
+    METRIC_HIST_PRIORITY_DELIVERY_MS,
+    METRIC_HIST_COUNT,
+} metric_histogram_t;
+
+// Bucket i counts values below 2^i ms, the last one everything above
+#define METRICS_HISTOGRAM_BUCKETS 16
+
+typedef struct
+{
+    uint32_t buckets[METRICS_HISTOGRAM_BUCKETS];
+    uint32_t count;
+    // Wraps around, the backend uses the difference between heartbeats
+    uint32_t sum_ms;
+} metrics_histogram_t;
+
+// Sum of every core at the time of the snapshot
+typedef struct
+{
+    uint32_t counters[METRIC_COUNTER_COUNT];
+    uint32_t gauges[METRIC_GAUGE_COUNT];
+    metrics_histogram_t histograms[METRIC_HIST_COUNT];
+} metrics_snapshot_t;
+
+// Version of the heartbeat body written by metrics_encode
+#define METRICS_HEARTBEAT_VERSION 1
+
+// Largest heartbeat body
+#define METRICS_HEARTBEAT_SIZE (9 + 4 * (METRIC_COUNTER_COUNT + METRIC_GAUGE_COUNT) + \
+                                METRIC_HIST_COUNT * 4 * (2 + METRICS_HISTOGRAM_BUCKETS))
+
+void metrics_add(metric_counter_t counter, uint32_t value);
+void metrics_count(metric_counter_t counter);
+void metrics_count_http_status(int status);
+void metrics_gauge(metric_gauge_t gauge, uint32_t value);
+void metrics_record(metric_histogram_t histogram, uint32_t value_ms);
+void metrics_snapshot(metrics_snapshot_t *snapshot);
+size_t metrics_encode(const metrics_snapshot_t *snapshot, uint8_t *buffer, size_t size);
+esp_err_t metrics_start_server(void);
+
+#endif
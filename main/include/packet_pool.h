@@ -0,0 +1,35 @@
+#ifndef _PACKET_POOL_H_
+#define _PACKET_POOL_H_
+
+#include "esp_err.h"
+#include <stdint.h>
+#include "lora.h"
+
+// Returned by packet_pool_acquire when every slot is in use
+#define PACKET_POOL_INVALID_SLOT 0xff
+
+// Index of a packet slot in the pool.
+// Only the index travels through the queues, the
+// packet itself stays in the preallocated slot
+typedef uint8_t packet_slot_t;
+
+// Packet pool usage counters
+typedef struct
+{
+    // Number of slots in the pool
+    uint8_t capacity;
+    // Number of slots currently owned by a task
+    uint8_t in_use;
+    // Largest number of slots that were in use at once
+    uint8_t high_water;
+    // Number of times a slot was requested while the pool was empty
+    uint32_t exhausted;
+} packet_pool_stats_t;
+
+esp_err_t packet_pool_init(void);
+packet_slot_t packet_pool_acquire(void);
+void packet_pool_release(packet_slot_t slot);
+lora_packet_t *packet_pool_get(packet_slot_t slot);
+void packet_pool_get_stats(packet_pool_stats_t *stats);
+
+#endif
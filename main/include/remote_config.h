@@ -0,0 +1,76 @@
+#ifndef _REMOTE_CONFIG_H_
+#define _REMOTE_CONFIG_H_
+
+#include "esp_err.h"
+#include <stdbool.h>
+#include <stdint.h>
+#include "esp_bit_defs.h"
+#include "lora.h"
+#include "rx_scheduler.h"
+
+// Format of the configuration blob
+#define REMOTE_CONFIG_FORMAT 1
+
+// Largest blob kept in NVS
+#define REMOTE_CONFIG_MAX_SIZE 256
+
+// Longest uplink host, scheme included
+#define REMOTE_CONFIG_HOST_MAX 64
+
+// Receiver configuration blob sent by the backend with
+// UPLINK_REPLY_FLAG_CONFIG, its version travels in the reply:
+//   uint8_t  format
+//   repeated until the end of the blob:
+//     uint8_t  key
+//     uint8_t  value length
+//     uint8_t  value[value length], little endian
+// The blob is the whole configuration the backend holds,
+// settings it leaves out go back to the firmware defaults.
+// Unknown keys are skipped, so older receivers accept newer blobs
+#define REMOTE_CONFIG_KEY_FREQUENCY 0x01         // uint32_t Hz
+#define REMOTE_CONFIG_KEY_BANDWIDTH 0x02         // uint32_t Hz
+#define REMOTE_CONFIG_KEY_CODING_RATE 0x03       // uint8_t 5 to 8 (4/5 to 4/8)
+#define REMOTE_CONFIG_KEY_PREAMBLE_LENGTH 0x04   // uint16_t symbols
+#define REMOTE_CONFIG_KEY_SPREADING_FACTORS 0x05 // uint8_t[1 to 6], 7 to 12
+#define REMOTE_CONFIG_KEY_UPLINK_HOST 0x10       // char[], "https://host[:port]", http:// only with REMOTE_CONFIG_ALLOW_HTTP
+#define REMOTE_CONFIG_KEY_UPLINK_TIMEOUT_MS 0x11 // uint32_t
+#define REMOTE_CONFIG_KEY_BATCH_MAX_WAIT_MS 0x12 // uint32_t
+#define REMOTE_CONFIG_KEY_BATCH_MAX_PACKETS 0x13 // uint8_t
+
+// Which settings of the blob are set
+#define REMOTE_CONFIG_HAS_FREQUENCY BIT(0)
+#define REMOTE_CONFIG_HAS_BANDWIDTH BIT(1)
+#define REMOTE_CONFIG_HAS_CODING_RATE BIT(2)
+#define REMOTE_CONFIG_HAS_PREAMBLE_LENGTH BIT(3)
+#define REMOTE_CONFIG_HAS_SPREADING_FACTORS BIT(4)
+#define REMOTE_CONFIG_HAS_UPLINK_HOST BIT(5)
+#define REMOTE_CONFIG_HAS_UPLINK_TIMEOUT BIT(6)
+#define REMOTE_CONFIG_HAS_BATCH_MAX_WAIT BIT(7)
+#define REMOTE_CONFIG_HAS_BATCH_MAX_PACKETS BIT(8)
+
+// A parsed configuration blob
+typedef struct
+{
+    // Zero until the backend sent a configuration
+    uint32_t version;
+    uint32_t fields;
+    // Radio
+    uint32_t frequency;
+    uint32_t bandwidth;
+    uint8_t coding_rate;
+    uint16_t preamble_length;
+    uint8_t spreading_factors[RX_SCHEDULER_MAX_PROFILES];
+    uint8_t spreading_factor_count;
+    // Uplink
+    char uplink_host[REMOTE_CONFIG_HOST_MAX];
+    uint32_t uplink_timeout_ms;
+    uint32_t batch_max_wait_ms;
+    uint8_t batch_max_packets;
+} remote_config_t;
+
+esp_err_t remote_config_init(void);
+esp_err_t remote_config_update(uint32_t version, const uint8_t *blob, size_t length);
+bool remote_config_changed(uint32_t *generation, remote_config_t *config);
+void remote_config_radio(const remote_config_t *config, lora_modem_profile_t *profile, uint8_t *spreading_factors, int *count);
+
+#endif
@@ -0,0 +1,42 @@
+#ifndef _RX_FILTER_H_
+#define _RX_FILTER_H_
+
+#include "esp_err.h"
+#include <stdint.h>
+#include "lora.h"
+#include "ingest.h"
+
+// Most node ids the allowlist and the priority list hold
+#define RX_FILTER_MAX_NODES 128
+
+// Message id bit of urgent packets, with INGEST_PRIORITY_FLAG
+#define RX_FILTER_PRIORITY_FLAG 0x80000000u
+
+// Smallest frame, the node id and message id
+#define RX_FILTER_HEADER_SIZE 8
+
+// Outcome of the receive filter, every reject reason has its counter
+typedef enum
+{
+    RX_FILTER_ACCEPT,
+    // Too short for the header (and the tag)
+    RX_FILTER_TOO_SHORT,
+    // Node id not on the allowlist
+    RX_FILTER_UNKNOWN_NODE,
+    // Tag does not match the frame
+    RX_FILTER_BAD_TAG,
+    RX_FILTER_RESULT_COUNT,
+} rx_filter_result_t;
+
+// Frames per filter outcome
+typedef struct
+{
+    uint32_t frames[RX_FILTER_RESULT_COUNT];
+} rx_filter_stats_t;
+
+esp_err_t rx_filter_init(void);
+rx_filter_result_t rx_filter_check(lora_packet_t *packet, lora_header_t *header);
+ingest_lane_t rx_filter_lane(const lora_header_t *header);
+void rx_filter_get_stats(rx_filter_stats_t *stats);
+
+#endif
@@ -0,0 +1,47 @@
+#ifndef _RX_SCHEDULER_H_
+#define _RX_SCHEDULER_H_
+
+#include "esp_err.h"
+#include <stdbool.h>
+#include <stdint.h>
+#include "freertos/FreeRTOS.h"
+#include "lora.h"
+
+// Most spreading factors the scheduler cycles through, 7 to 12
+#define RX_SCHEDULER_MAX_PROFILES 6
+
+// Counters of one modem profile
+typedef struct
+{
+    uint8_t spreading_factor;
+    // Channel activity detections run on the profile
+    // and those which found a preamble
+    uint32_t cad_runs;
+    uint32_t cad_hits;
+    // Packets received on the profile
+    uint32_t packets;
+    // Time spent receiving after a detection
+    uint32_t listen_ms;
+} rx_scheduler_profile_stats_t;
+
+// Receive scheduler counters
+typedef struct
+{
+    uint8_t profiles;
+    // Switches to the next profile
+    uint32_t hops;
+    rx_scheduler_profile_stats_t profile[RX_SCHEDULER_MAX_PROFILES];
+} rx_scheduler_stats_t;
+
+esp_err_t rx_scheduler_init(void);
+esp_err_t rx_scheduler_configure(const lora_modem_profile_t *base, const uint8_t *spreading_factors, int count);
+void rx_scheduler_get_defaults(lora_modem_profile_t *base, uint8_t *spreading_factors, int *count);
+bool rx_scheduler_active(void);
+TickType_t rx_scheduler_poll(int64_t now_us);
+void rx_scheduler_packet(void);
+int rx_scheduler_current(void);
+void rx_scheduler_tx_profile(int index);
+void rx_scheduler_get_stats(rx_scheduler_stats_t *stats);
+void rx_scheduler_report(void);
+
+#endif
@@ -0,0 +1,47 @@
+#ifndef _SPOOL_H_
+#define _SPOOL_H_
+
+#include "esp_err.h"
+#include <stdbool.h>
+#include <stdint.h>
+#include "uplink_batch.h"
+
+// Spool counters
+typedef struct
+{
+    // Size of the spool partition
+    uint32_t capacity_bytes;
+    // Flash taken by records which are not uploaded yet
+    uint32_t used_bytes;
+    // Records which are not uploaded yet
+    uint32_t records;
+    // Records written, uploaded and overwritten before they were uploaded
+    uint32_t appended;
+    uint32_t drained;
+    uint32_t dropped;
+    // Records skipped because their CRC did not match
+    uint32_t corrupt;
+    // Uploaded records per second, smoothed
+    float drain_rate;
+    // Age of the oldest record in seconds
+    uint32_t oldest_age_sec;
+} spool_stats_t;
+
+// Position of a batch read from the spool,
+// passed back to spool_consume once it is uploaded
+typedef struct
+{
+    uint32_t start;
+    uint32_t end;
+    uint16_t records;
+} spool_cursor_t;
+
+esp_err_t spool_init(void);
+esp_err_t spool_append(const uint8_t *frame, size_t size);
+esp_err_t spool_append_batch(const uplink_batch_t *batch);
+int spool_read_batch(uplink_batch_t *batch, int max_frames, spool_cursor_t *cursor);
+esp_err_t spool_consume(const spool_cursor_t *cursor);
+bool spool_empty(void);
+void spool_get_stats(spool_stats_t *stats);
+
+#endif
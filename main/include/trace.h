@@ -0,0 +1,52 @@
+#ifndef _TRACE_H_
+#define _TRACE_H_
+
+#include "esp_err.h"
+#include <stdint.h>
+
+// Number of records in the trace ring
+#define TRACE_BUFFER_RECORDS (1 << CONFIG_TRACE_BUFFER_ORDER)
+
+// Traced events, the meaning of the arguments is
+// listed next to every event and used by the formatter
+typedef enum
+{
+    // arg0: -, arg1: -
+    TRACE_HTTP_ERROR,
+    // arg0: -, arg1: connect time in microseconds
+    TRACE_HTTP_CONNECTED,
+    // arg0: -, arg1: -
+    TRACE_HTTP_HEADER_SENT,
+    // arg0: negated mbedtls error, arg1: esp_tls error
+    TRACE_HTTP_DISCONNECTED,
+    // arg0: http status, arg1: frames
+    TRACE_UPLOAD_DONE,
+    // arg0: attempt, arg1: esp_err_t
+    TRACE_UPLOAD_FAILED,
+    // arg0: attempt, arg1: http status
+    TRACE_UPLOAD_REJECTED,
+    // arg0: frames, arg1: -
+    TRACE_BATCH_DROPPED,
+    // arg0: -, arg1: -
+    TRACE_POOL_EXHAUSTED,
+    TRACE_EVENT_COUNT,
+} trace_event_t;
+
+// A fixed size event record.
+// seq is cleared before the other fields are written and set
+// after them, a reader which sees the sequence number it
+// expects before and after copying knows the copy is complete
+typedef struct
+{
+    uint32_t seq;
+    uint32_t time_ms;
+    uint16_t event;
+    uint16_t arg0;
+    uint32_t arg1;
+} trace_record_t;
+
+esp_err_t trace_init(void);
+void trace_event(trace_event_t event, uint16_t arg0, uint32_t arg1);
+void trace_dump(void);
+
+#endif
@@ -0,0 +1,123 @@
+#ifndef _UPLINK_H_
+#define _UPLINK_H_
+
+#include "esp_err.h"
+#include <stdbool.h>
+#include <stdint.h>
+#include "esp_http_client.h"
+
+// Uplink connection counters
+typedef struct
+{
+    uint32_t requests;
+    uint32_t failures;
+    // New connections which had no saved TLS session to offer,
+    // they always go through a full handshake
+    uint32_t full_handshakes;
+    // New connections which offered a saved TLS session. Whether
+    // the backend resumed it is not visible through esp_http_client,
+    // after a backend restart or an expired ticket they are full
+    // handshakes as well
+    uint32_t session_offers;
+    // Total time spent connecting, split the same way. Offers
+    // which connect no faster than full handshakes show that
+    // the backend does not resume the sessions
+    int64_t full_handshake_us;
+    int64_t session_offer_us;
+    // Connections closed after a failed request
+    uint32_t reconnects;
+} uplink_stats_t;
+
+// Request state machine
+typedef enum
+{
+    // No request, a new one can be started
+    UPLINK_STATE_IDLE,
+    // The request is being performed
+    UPLINK_STATE_SENDING,
+    // The last attempt failed, waiting for the reconnect delay
+    UPLINK_STATE_BACKOFF,
+} uplink_state_t;
+
+// What uplink_poll reports back
+typedef enum
+{
+    UPLINK_RESULT_IDLE,
+    UPLINK_RESULT_IN_PROGRESS,
+    UPLINK_RESULT_DONE,
+    // Every attempt failed, the request was given up
+    UPLINK_RESULT_FAILED,
+    // The backend refused the request with a 4xx status,
+    // sending it again would get the same answer
+    UPLINK_RESULT_REJECTED,
+} uplink_result_t;
+
+// Reply body of the backend, little endian:
+//   uint8_t  version
+//   uint8_t  flags
+//   uint32_t sequence number of the last batch the backend stored
+//   uint32_t version of the receiver configuration it holds
+//   with UPLINK_REPLY_FLAG_CONFIG:
+//     uint16_t config size
+//     uint8_t  config[config size]
+#define UPLINK_REPLY_VERSION 1
+#define UPLINK_REPLY_HEADER_SIZE 10
+#define UPLINK_REPLY_FLAG_CONFIG 0x01
+
+// Longest request url, the backend host and the request path
+#define UPLINK_URL_MAX_SIZE 96
+
+// The parsed reply of the last successful request
+typedef struct
+{
+    // False if the body was empty, truncated or not understood
+    bool valid;
+    uint8_t flags;
+    uint32_t ack_sequence;
+    uint32_t config_version;
+    // Points into the response arena of the client
+    const uint8_t *config;
+    size_t config_length;
+} uplink_reply_t;
+
+// A persistent connection to the backend
+typedef struct
+{
+    esp_http_client_handle_t client;
+    uplink_state_t state;
+    // Urls of the batches and the heartbeat, built from the
+    // backend host. Url and content encoding the client currently uses
+    char data_url[UPLINK_URL_MAX_SIZE];
+    char heartbeat_url[UPLINK_URL_MAX_SIZE];
+    const char *url;
+    const char *encoding;
+    // Number of frames in the request body and
+    // the failed attempts at sending it
+    int frames;
+    int attempt;
+    // Set once a TLS session was established and saved by the client
+    bool session_saved;
+    // Start of the request which is being performed
+    int64_t request_start_us;
+    // Current reconnect delay and the time before which
+    // no new request is attempted
+    uint32_t backoff_ms;
+    int64_t retry_at_us;
+    uplink_stats_t stats;
+    // Response arena, filled by the event handler without
+    // allocating and parsed into the reply once the request is done
+    uint8_t response[CONFIG_UPLINK_RESPONSE_MAX_SIZE];
+    size_t response_length;
+    bool response_truncated;
+    uplink_reply_t reply;
+} uplink_client_t;
+
+esp_err_t uplink_client_init(uplink_client_t *uplink);
+esp_err_t uplink_configure(uplink_client_t *uplink, const char *host, uint32_t timeout_ms, uint32_t config_version);
+esp_err_t uplink_start(uplink_client_t *uplink, const uint8_t *body, size_t length, int frames, const char *encoding);
+esp_err_t uplink_start_heartbeat(uplink_client_t *uplink, const uint8_t *body, size_t length);
+uplink_result_t uplink_poll(uplink_client_t *uplink);
+bool uplink_busy(const uplink_client_t *uplink);
+void uplink_get_stats(uplink_client_t *uplink, uplink_stats_t *stats);
+
+#endif
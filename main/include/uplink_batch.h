@@ -0,0 +1,69 @@
+#ifndef _UPLINK_BATCH_H_
+#define _UPLINK_BATCH_H_
+
+#include "esp_err.h"
+#include <stdbool.h>
+#include <stdint.h>
+#include "lora.h"
+
+// Size of the batch header: framing version and frame count
+#define UPLINK_BATCH_HEADER_SIZE 2
+
+// Every frame is prefixed with its length as a little endian uint16
+#define UPLINK_BATCH_FRAME_HEADER_SIZE 2
+
+// Size of the radio metadata in front of the payload, framing
+// version 2 and version 3 which adds the boot counter
+#define UPLINK_BATCH_ENVELOPE_V2_SIZE 10
+#define UPLINK_BATCH_ENVELOPE_SIZE 14
+
+// Largest encoded frame, metadata envelope and payload
+#define UPLINK_BATCH_FRAME_MAX_SIZE (UPLINK_BATCH_ENVELOPE_SIZE + LORA_MAX_PACKET_SIZE)
+
+// Largest possible batch body
+#define UPLINK_BATCH_BUFFER_SIZE (UPLINK_BATCH_HEADER_SIZE + CONFIG_UPLINK_BATCH_MAX_PACKETS * (UPLINK_BATCH_FRAME_HEADER_SIZE + UPLINK_BATCH_FRAME_MAX_SIZE))
+
+// A batch of lora packets encoded as a single request body
+//
+// Framing version 1:
+//   uint8_t  version
+//   uint8_t  frame count
+//   repeated frame count times:
+//     uint16_t payload size (little endian)
+//     uint8_t  payload[payload size]
+//
+// Framing version 2 puts the radio metadata in front of every payload,
+// the frame size covers both. All fields are little endian:
+//   uint8_t  version
+//   uint8_t  frame count
+//   repeated frame count times:
+//     uint16_t frame size
+//     int16_t  rssi in dBm
+//     int8_t   snr in quarter dB
+//     int24_t  frequency error in Hz
+//     uint32_t receive time in milliseconds since boot (monotonic)
+//     uint8_t  payload[frame size - 10]
+//
+// Framing version 3 adds the boot the receive time counts from,
+// spooled frames are often uploaded after a reboot:
+//   ...
+//     uint32_t receive time in milliseconds since boot (monotonic)
+//     uint32_t boot counter, 0 if unknown
+//     uint8_t  payload[frame size - 14]
+typedef struct
+{
+    uint8_t body[UPLINK_BATCH_BUFFER_SIZE];
+    size_t length;
+    uint8_t count;
+} uplink_batch_t;
+
+esp_err_t uplink_batch_init(void);
+size_t uplink_batch_envelope_size(uint8_t framing);
+void uplink_batch_reset(uplink_batch_t *batch);
+bool uplink_batch_add(uplink_batch_t *batch, const lora_packet_t *packet);
+bool uplink_batch_add_frame(uplink_batch_t *batch, const uint8_t *frame, size_t size);
+bool uplink_batch_next_frame(const uplink_batch_t *batch, size_t *offset, const uint8_t **frame, size_t *size);
+bool uplink_batch_full(const uplink_batch_t *batch);
+void uplink_batch_set_limit(uint8_t max_packets);
+
+#endif
@@ -0,0 +1,48 @@
+#ifndef _UPLINK_CODEC_H_
+#define _UPLINK_CODEC_H_
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include "uplink_batch.h"
+
+// Content-Encoding of a compressed batch
+#define UPLINK_CODEC_ENCODING "x-lora-delta-lz4"
+
+// Version of the compressed body
+#define UPLINK_CODEC_VERSION 1
+
+// Size of the header in front of the compressed data
+#define UPLINK_CODEC_HEADER_SIZE 3
+
+// Entries of the match finder hash table
+#define UPLINK_CODEC_HASH_BITS 10
+
+// Compressed batch body, all fields little endian:
+//   uint8_t  codec version
+//   uint16_t size of the batch body once decoded
+//   uint8_t  lz4 block[]
+//
+// The lz4 block holds the batch body with every payload
+// delta coded: when an earlier frame of the batch came from
+// the same node (the first 4 payload bytes), every payload
+// byte after the node id is XORed with the byte at the same
+// position of the latest such frame, as far as both reach.
+// Frames of one node mostly differ in a few counters,
+// so their deltas are runs of zeros lz4 compresses well
+typedef struct
+{
+    // The delta coded batch body
+    uint8_t scratch[UPLINK_BATCH_BUFFER_SIZE];
+    // Last input position of every hash of 4 bytes
+    uint16_t table[1 << UPLINK_CODEC_HASH_BITS];
+    // The compressed body, never larger than the batch
+    // as batches which do not shrink are sent as they are
+    uint8_t encoded[UPLINK_BATCH_BUFFER_SIZE];
+    size_t length;
+} uplink_codec_t;
+
+bool uplink_codec_encode(uplink_codec_t *codec, const uplink_batch_t *batch);
+bool uplink_codec_decode(const uint8_t *body, size_t length, uplink_batch_t *batch);
+
+#endif
@@ -0,0 +1,238 @@
+#include "ingest.h"
+#include "esp_bit_defs.h"
+#include "freertos/task.h"
+
+// Upper bound of distinct nodes the fairness policy
+// compares when looking for the busiest node
+#define INGEST_FAIR_TRACKED_NODES 16
+
+esp_err_t ingest_init(ingest_queue_t *queue, ingest_overflow_policy_t policy, uint8_t consumers) {
+    if (queue == NULL || consumers == 0 || consumers > INGEST_MAX_CONSUMERS) {
+        return ESP_ERR_INVALID_ARG;
+    }
+
+    *queue = (ingest_queue_t){
+        .policy = policy,
+        .consumers = consumers,
+        .lock = portMUX_INITIALIZER_UNLOCKED,
+    };
+
+    // Wakes up the consumer of a node when one of its packets is pushed
+    queue->ready = xEventGroupCreateStatic(&queue->ready_buffer);
+    if (queue->ready == NULL) {
+        return ESP_FAIL;
+    }
+
+    return ESP_OK;
+}
+
+// Gives a lane its ring. Packets pushed to a lane
+// without one go to the bulk lane
+esp_err_t ingest_init_lane(ingest_queue_t *queue, ingest_lane_t lane, ingest_entry_t *storage, uint16_t capacity) {
+    if (queue == NULL || lane >= INGEST_LANE_COUNT || storage == NULL || capacity == 0) {
+        return ESP_ERR_INVALID_ARG;
+    }
+
+    queue->lanes[lane] = (ingest_ring_t){
+        .ring = storage,
+        .capacity = capacity,
+    };
+
+    return ESP_OK;
+}
+
+// Removes the entry at the given offset from the head
+// and closes the gap by moving the newer entries back.
+// Must be called with the lock held
+static ingest_entry_t ingest_remove_at(ingest_ring_t *ring, uint16_t offset) {
+    ingest_entry_t removed = ring->ring[(ring->head + offset) % ring->capacity];
+
+    // Taking the oldest entry only moves the head
+    if (offset == 0) {
+        ring->head = (ring->head + 1) % ring->capacity;
+        ring->count--;
+        return removed;
+    }
+
+    for (uint16_t i = offset; i + 1 < ring->count; i++) {
+        ring->ring[(ring->head + i) % ring->capacity] = ring->ring[(ring->head + i + 1) % ring->capacity];
+    }
+    ring->count--;
+
+    return removed;
+}
+
+// Picks the packet the fairness policy evicts: the oldest
+// packet of the node with the most queued packets.
+// Returns -1 when the arriving packet itself should be dropped.
+// Must be called with the lock held
+static int ingest_fair_victim(ingest_ring_t *ring, uint32_t node_id) {
+    uint32_t nodes[INGEST_FAIR_TRACKED_NODES];
+    uint16_t counts[INGEST_FAIR_TRACKED_NODES];
+    uint16_t oldest[INGEST_FAIR_TRACKED_NODES];
+    int tracked = 0;
+    int busiest = -1;
+    uint16_t own_count = 0;
+
+    for (uint16_t i = 0; i < ring->count; i++) {
+        uint32_t node = ring->ring[(ring->head + i) % ring->capacity].node_id;
+
+        if (node == node_id) {
+            own_count++;
+        }
+
+        int n = 0;
+        while (n < tracked && nodes[n] != node) {
+            n++;
+        }
+
+        if (n == tracked) {
+            // Nodes beyond the tracked limit can not become
+            // the victim, they only have a few packets queued anyway
+            if (tracked == INGEST_FAIR_TRACKED_NODES) {
+                continue;
+            }
+            nodes[n] = node;
+            counts[n] = 0;
+            oldest[n] = i;
+            tracked++;
+        }
+
+        counts[n]++;
+        if (busiest < 0 || counts[n] > counts[busiest]) {
+            busiest = n;
+        }
+    }
+
+    // The arriving node already holds the largest share
+    // so its own new packet is the one to go
+    if (busiest < 0 || own_count + 1 > counts[busiest]) {
+        return -1;
+    }
+
+    return oldest[busiest];
+}
+
+uint8_t ingest_consumer_of(const ingest_queue_t *queue, uint32_t node_id) {
+    // Node ids are often handed out sequentially,
+    // the multiplicative hash spreads them evenly
+    return ((node_id * 2654435761u) >> 16) % queue->consumers;
+}
+
+bool ingest_push(ingest_queue_t *queue, ingest_lane_t lane, packet_slot_t slot, uint32_t node_id) {
+    packet_slot_t dropped = PACKET_POOL_INVALID_SLOT;
+    bool accepted = true;
+
+    if (queue->lanes[lane].capacity == 0) {
+        lane = INGEST_LANE_BULK;
+    }
+    ingest_ring_t *ring = &queue->lanes[lane];
+
+    portENTER_CRITICAL(&queue->lock);
+
+    if (ring->count == ring->capacity) {
+        switch (queue->policy) {
+            case INGEST_OVERFLOW_DROP_OLDEST:
+                dropped = ingest_remove_at(ring, 0).slot;
+                ring->stats.dropped_oldest++;
+                break;
+            case INGEST_OVERFLOW_DROP_NEWEST:
+                dropped = slot;
+                accepted = false;
+                ring->stats.dropped_newest++;
+                break;
+            case INGEST_OVERFLOW_NODE_FAIR: {
+                int victim = ingest_fair_victim(ring, node_id);
+                if (victim < 0) {
+                    dropped = slot;
+                    accepted = false;
+                } else {
+                    dropped = ingest_remove_at(ring, victim).slot;
+                }
+                ring->stats.dropped_fair++;
+                break;
+            }
+        }
+    }
+
+    if (accepted) {
+        ring->ring[(ring->head + ring->count) % ring->capacity] = (ingest_entry_t){
+            .slot = slot,
+            .node_id = node_id,
+        };
+        ring->count++;
+        ring->stats.pushed++;
+        if (ring->count > ring->stats.high_water) {
+            ring->stats.high_water = ring->count;
+        }
+    }
+
+    portEXIT_CRITICAL(&queue->lock);
+
+    // The queue owns every slot pushed into it,
+    // so the dropped one goes back to the pool
+    if (dropped != PACKET_POOL_INVALID_SLOT) {
+        packet_pool_release(dropped);
+    }
+
+    if (accepted) {
+        xEventGroupSetBits(queue->ready, BIT(ingest_consumer_of(queue, node_id)));
+    }
+
+    return accepted;
+}
+
+// Takes a packet of one of the lanes in the lanes bit mask,
+// from the most urgent lane which holds one
+bool ingest_pop(ingest_queue_t *queue, uint8_t consumer, uint8_t lanes, packet_slot_t *slot, ingest_lane_t *lane, TickType_t timeout) {
+    TickType_t start = xTaskGetTickCount();
+
+    while (1) {
+        // Takes the oldest packet of the nodes this consumer serves,
+        // the packets of the other consumers keep their place
+        portENTER_CRITICAL(&queue->lock);
+        for (ingest_lane_t l = 0; l < INGEST_LANE_COUNT; l++) {
+            ingest_ring_t *ring = &queue->lanes[l];
+            if ((lanes & BIT(l)) == 0) {
+                continue;
+            }
+
+            for (uint16_t i = 0; i < ring->count; i++) {
+                uint32_t node = ring->ring[(ring->head + i) % ring->capacity].node_id;
+                if (ingest_consumer_of(queue, node) == consumer) {
+                    *slot = ingest_remove_at(ring, i).slot;
+                    *lane = l;
+                    ring->stats.popped++;
+                    portEXIT_CRITICAL(&queue->lock);
+                    return true;
+                }
+            }
+        }
+        portEXIT_CRITICAL(&queue->lock);
+
+        // The ready bit may still be set from packets
+        // which were already popped, or be set by a lane
+        // the caller skips, so keep waiting for whatever
+        // is left of the timeout
+        TickType_t remaining = portMAX_DELAY;
+        if (timeout != portMAX_DELAY) {
+            TickType_t waited = xTaskGetTickCount() - start;
+            if (waited >= timeout) {
+                return false;
+            }
+            remaining = timeout - waited;
+        }
+
+        EventBits_t bit = BIT(consumer);
+        if ((xEventGroupWaitBits(queue->ready, bit, pdTRUE, pdFALSE, remaining) & bit) == 0) {
+            return false;
+        }
+    }
+}
+
+void ingest_get_stats(ingest_queue_t *queue, ingest_lane_t lane, ingest_stats_t *stats) {
+    portENTER_CRITICAL(&queue->lock);
+    *stats = queue->lanes[lane].stats;
+    stats->depth = queue->lanes[lane].count;
+    portEXIT_CRITICAL(&queue->lock);
+}
@@ -1,7 +1,9 @@
+#include <stdio.h>
 #include <string.h>
 #include <sys/param.h>
 #include <stdlib.h>
 #include <ctype.h>
+#include <inttypes.h>
 #include "esp_log.h"
 #include "nvs_flash.h"
 #include "esp_event.h"
@@ -12,248 +14,699 @@
 #include "esp_crt_bundle.h"
 #include "freertos/FreeRTOS.h"
 #include "freertos/task.h"
+#include "freertos/event_groups.h"
 #include "esp_system.h"
+#include "esp_timer.h"
+#include "esp_heap_caps.h"
+#include "esp_bit_defs.h"
 
 #include "esp_http_client.h"
 #include "freertos/queue.h"
 #include "lora.h"
-
-#define MAX_HTTP_RECV_BUFFER 512
-#define MAX_HTTP_OUTPUT_BUFFER 2048
-
-// The backend authentication token
-#define BACKEND_AUTH_TOKEN "uO0Ofm2uGvOYG3p67kffMlUBP7uYPM"
+#include "packet_pool.h"
+#include "ingest.h"
+#include "uplink_batch.h"
+#include "dedup.h"
+#include "rx_filter.h"
+#include "ack.h"
+#include "rx_scheduler.h"
+#include "remote_config.h"
+#include "uplink.h"
+#include "uplink_codec.h"
+#include "spool.h"
+#include "metrics.h"
+#include "trace.h"
+#if CONFIG_IDF_TARGET_LINUX
+#include "bench.h"
+#endif
 
 // Log tag
 static const char *TAG = "HTTP_CLIENT";
 
-// The google trust chain root certificate
-// for https
-extern const char gtsr1_root_cert_pem_start[] asm("_binary_gtsr1_root_cert_pem_start");
-extern const char gtsr1_root_cert_pem_end[] asm("_binary_gtsr1_root_cert_pem_end");
-
 // The lora packet queue
-static QueueHandle_t s_lora_queue_handler;
-
-// Packet history used for deduplication of packets if by chance any relay nodes see each other
-
-esp_err_t _http_event_handler(esp_http_client_event_t *evt) {
-    // Buffer to store response of the http request from event handler
-    static char *output_buffer;
-    // Stores number of bytes read
-    static int output_len;
-
-    switch (evt->event_id) {
-        case HTTP_EVENT_ERROR:
-            printf("EVENT ON ERROR\n");
-
-            ESP_LOGD(TAG, "HTTP_EVENT_ERROR");
-            break;
-        case HTTP_EVENT_ON_CONNECTED:
-            printf("EVENT ON CONNECTED\n");
-
-            ESP_LOGD(TAG, "HTTP_EVENT_ON_CONNECTED");
-            break;
-        case HTTP_EVENT_HEADER_SENT:
-            printf("EVENT ON HEADER SENT\n");
-
-            ESP_LOGD(TAG, "HTTP_EVENT_HEADER_SENT");
-            break;
-        case HTTP_EVENT_ON_HEADER:
-            //printf("EVENT ON HEADER\n");
-            ESP_LOGD(TAG, "HTTP_EVENT_ON_HEADER, key=%s, value=%s", evt->header_key, evt->header_value);
-            break;
-        case HTTP_EVENT_ON_DATA:
-            // Check whether the response data is presented
-            // as a chunked response and ignore it if it is 
-            if (!esp_http_client_is_chunked_response(evt->client)) {
-                int copy_len = 0;
-
-                if (evt->user_data) {
-                    copy_len = MIN(evt->data_len, (MAX_HTTP_OUTPUT_BUFFER - output_len));
-                    if (copy_len) {
-                        memcpy(evt->user_data + output_len, evt->data, copy_len);
-                    }
-                } else {
-                    // Reads the content length header to determine response body size
-                    const int buffer_len = esp_http_client_get_content_length(evt->client);
-                    if (output_buffer == NULL) {
-                        // If the buffer has not been already allocated
-                        // it allocates it using the received size
-                        output_buffer = (char *)malloc(buffer_len);
-
-                        // Clears it before actually using it
-                        output_len = 0;
-
-                        // Checks whether we do not have enough memory
-                        if (output_buffer == NULL) {
-                            return ESP_FAIL;
-                        }
-                    }
-
-                    // Copy the response data into the previously allocated
-                    // buffer
-                    copy_len = MIN(evt->data_len, (buffer_len - output_len));
-                    if (copy_len) {
-                        memcpy(output_buffer + output_len, evt->data, copy_len);
-                    }
-                }
-
-                output_len += copy_len;
-            }
-
-            break;
-        case HTTP_EVENT_ON_FINISH:
-            if (output_buffer != NULL)
-            {
-                free(output_buffer);
-                output_buffer = NULL;
-            }
-            output_len = 0;
-            break;
-        case HTTP_EVENT_DISCONNECTED:
-            int mbedtls_err = 0;
-            esp_err_t err = esp_tls_get_and_clear_last_error((esp_tls_error_handle_t)evt->data, &mbedtls_err, NULL);
-            if (err != 0) {
-                ESP_LOGI(TAG, "Last esp error code: 0x%x", err);
-                ESP_LOGI(TAG, "Last mbedtls failure: 0x%x", mbedtls_err);
-            }
-
-            if (output_buffer != NULL) {
-                free(output_buffer);
-                output_buffer = NULL;
-            }
-            output_len = 0;
-            break;
-        default:
-            // Not interested
+// It carries packet pool slot indices, the packets
+// themselves stay in the packet pool
+static ingest_queue_t s_lora_queue;
+static ingest_entry_t s_lora_queue_storage[CONFIG_INGEST_QUEUE_DEPTH];
+static ingest_entry_t s_lora_priority_storage[CONFIG_INGEST_PRIORITY_DEPTH];
+
+#if CONFIG_INGEST_OVERFLOW_DROP_OLDEST
+#define INGEST_OVERFLOW_POLICY INGEST_OVERFLOW_DROP_OLDEST
+#elif CONFIG_INGEST_OVERFLOW_DROP_NEWEST
+#define INGEST_OVERFLOW_POLICY INGEST_OVERFLOW_DROP_NEWEST
+#else
+#define INGEST_OVERFLOW_POLICY INGEST_OVERFLOW_NODE_FAIR
+#endif
+
+// Longest time the receive task sleeps waiting for the
+// DIO0 interrupt before checking the radio anyway,
+// so a missed edge can not make the receiver deaf
+#define LORA_RX_INTERRUPT_TIMEOUT_MS 1000
+
+// An uplink worker. Every worker owns a persistent
+// connection to the backend and uploads the packets of
+// the nodes the ingest queue assigns to it
+typedef struct
+{
+    uint8_t index;
+    TaskHandle_t task;
+    uplink_client_t uplink;
+    // Batches of lora packets. One is being sent while
+    // the other one collects the packets which arrive meanwhile
+    uplink_batch_t batches[2];
+    // Collects the packets of the priority lane, which are
+    // sent as soon as the uplink is free
+    uplink_batch_t urgent;
+#if CONFIG_UPLINK_COMPRESSION
+    // Holds the compressed body of the batch in flight
+    uplink_codec_t codec;
+#endif
+    // Time the uplink spent on requests, and its
+    // value when the utilization was last published
+    int64_t busy_us;
+    int64_t reported_busy_us;
+    int64_t reported_at_us;
+} uplink_worker_t;
+
+static uplink_worker_t s_uplink_workers[CONFIG_UPLINK_WORKERS];
+
+// Every worker publishes its utilization in a gauge of its own
+_Static_assert(CONFIG_UPLINK_WORKERS <= METRIC_GAUGE_UPLINK3_BUSY_PCT - METRIC_GAUGE_UPLINK0_BUSY_PCT + 1,
+               "not enough uplink utilization gauges");
+
+// The radio task and the uplink workers run on different
+// cores, so TLS and socket work never delays reading the FIFO.
+// On single core chips both are core 0 and the radio task
+// only wins by its higher priority
+#if CONFIG_FREERTOS_UNICORE
+#define LORA_RX_TASK_CORE 0
+#define UPLINK_WORKER_CORE 0
+#else
+#define LORA_RX_TASK_CORE CONFIG_LORA_RX_TASK_CORE
+#define UPLINK_WORKER_CORE CONFIG_UPLINK_WORKER_CORE
+#endif
+
+static TaskHandle_t s_lora_rx_task;
+
+// Set once the first batch reached the backend
+static bool s_first_upload_done;
+
+#if CONFIG_METRICS_HEARTBEAT_INTERVAL_SEC > 0
+// Body of the heartbeat request, kept until it is sent
+static uint8_t s_heartbeat_body[METRICS_HEARTBEAT_SIZE];
+#endif
+
+// How often the queue, pool, spool and utilization gauges
+// are refreshed. Also the longest time a worker sleeps while idle
+#define METRICS_GAUGE_INTERVAL_MS 1000
+
+// How often the hit rates of the receive profiles are logged
+// while the radio cycles through more than one
+#define RX_SCHEDULER_REPORT_INTERVAL_MS 60000
+
+// Set once the wifi connection is up. The radio starts
+// receiving before that, the uploads wait for it.
+// The spool bit is set by the first worker once the spool
+// is mounted, the other workers may append to it from then on
+static EventGroupHandle_t s_network_events;
+#define NETWORK_CONNECTED_BIT BIT0
+#define SPOOL_READY_BIT BIT1
+
+// Publishes which share of the time since the last call
+// the worker spent on requests
+static void update_worker_gauge(uplink_worker_t *worker) {
+    int64_t now = esp_timer_get_time();
+    int64_t elapsed = now - worker->reported_at_us;
+
+    if (elapsed > 0) {
+        uint32_t busy_pct = (worker->busy_us - worker->reported_busy_us) * 100 / elapsed;
+        metrics_gauge(METRIC_GAUGE_UPLINK0_BUSY_PCT + worker->index, busy_pct);
     }
-   
-    return ESP_OK;
+
+    worker->reported_busy_us = worker->busy_us;
+    worker->reported_at_us = now;
 }
 
-// Client config
-// the url of the target server
-// the google trust chain root certificate for https
-// and a request timeout
+// Publishes the fill levels of the pipeline buffers
+static void update_gauges(void) {
+    ingest_stats_t ingest;
+    packet_pool_stats_t pool;
+    spool_stats_t spool;
 
-static esp_http_client_config_t s_config = {
-    .url = "https://dragonhack.ttcloud.io/api/data",
-    .event_handler = _http_event_handler,
-    .cert_pem = gtsr1_root_cert_pem_start,
-    .is_async = true,
-    .timeout_ms = 15000,
-};
+    ingest_get_stats(&s_lora_queue, INGEST_LANE_BULK, &ingest);
+    packet_pool_get_stats(&pool);
+    spool_get_stats(&spool);
 
-static void https_async(esp_http_client_handle_t client, lora_packet_t *packet) {
-    esp_err_t err;
-    char *payload = (const char *)(packet->payload);
+    metrics_gauge(METRIC_GAUGE_QUEUE_DEPTH, ingest.depth);
+    metrics_gauge(METRIC_GAUGE_POOL_IN_USE, pool.in_use);
+    metrics_gauge(METRIC_GAUGE_SPOOL_RECORDS, spool.records);
 
-    // Sets the request method to POST (as we are sending data)
-    esp_http_client_set_method(client, HTTP_METHOD_POST);
+    // Keeps the dedup clock which survives a reset current
+    dedup_tick(esp_timer_get_time());
+}
 
-    // Sets the request Authorization header which provides the auth token
-    esp_http_client_set_header(client, "Authorization", "Basic " BACKEND_AUTH_TOKEN);
+// Logs how long after boot a startup phase was reached,
+// esp_timer starts counting right before app_main
+static void boot_phase_reached(const char *phase) {
+    ESP_LOGI(TAG, "Boot: %s after %" PRId64 " ms", phase, esp_timer_get_time() / 1000);
+}
 
-    // Sets the request body (to the lora packet)
-    esp_http_client_set_post_field(client, payload, packet->payload_size);
+// Starts the upload of a batch, compressed when that makes it smaller.
+// The batch itself stays as it is, a failed one is spooled uncompressed
+static void start_batch_upload(uplink_worker_t *worker, const uplink_batch_t *batch) {
+#if CONFIG_UPLINK_COMPRESSION
+    if (uplink_codec_encode(&worker->codec, batch)) {
+        uplink_start(&worker->uplink, worker->codec.encoded, worker->codec.length, batch->count, UPLINK_CODEC_ENCODING);
+        return;
+    }
+#endif
+    uplink_start(&worker->uplink, batch->body, batch->length, batch->count, NULL);
+}
 
-    // Performs the request 
-    while (1) {
-        err = esp_http_client_perform(client);
-        if (err != ESP_ERR_HTTP_EAGAIN) {
-            break;
+#if CONFIG_TASK_HEADROOM_REPORT_SEC > 0
+// Logs how much of their stacks the pipeline tasks never
+// touched and how much heap is left. By the time it runs the
+// tasks went through their deepest call chains, the TLS
+// handshake and the first packets
+static void report_headroom(void) {
+    ESP_LOGI(TAG, "Headroom: lora_receive_task stack %u of %d bytes unused",
+             (unsigned)uxTaskGetStackHighWaterMark(s_lora_rx_task), CONFIG_LORA_RX_TASK_STACK_SIZE);
+
+    for (int i = 0; i < CONFIG_UPLINK_WORKERS; i++) {
+        if (s_uplink_workers[i].task != NULL) {
+            ESP_LOGI(TAG, "Headroom: uplink_%d stack %u of %d bytes unused", i,
+                     (unsigned)uxTaskGetStackHighWaterMark(s_uplink_workers[i].task), CONFIG_UPLINK_WORKER_STACK_SIZE);
         }
     }
 
-    // Prints the request status  code
-    // and the content length of the response body on success.
-    // Prints the error name in case of an error.
-
-    if (err == ESP_OK) {
-        ESP_LOGI(TAG, "HTTPS Status = %d, content_length = %" PRIu64,
-        esp_http_client_get_status_code(client),
-        esp_http_client_get_content_length(client));
-    } else {
-        ESP_LOGE(TAG, "Error perform http request %s", esp_err_to_name(err));
-    }
+#if !CONFIG_IDF_TARGET_LINUX
+    ESP_LOGI(TAG, "Headroom: heap %u bytes free, %u at the lowest, largest block %u",
+             (unsigned)heap_caps_get_free_size(MALLOC_CAP_8BIT),
+             (unsigned)heap_caps_get_minimum_free_size(MALLOC_CAP_8BIT),
+             (unsigned)heap_caps_get_largest_free_block(MALLOC_CAP_8BIT));
+#endif
 }
+#endif
 
 void http_transmit_task(void *pvParameters) {
-    // Initializes the client (we are sending a request to a server
-    // and as such are considered a client)
-    // with the url or the server
-    esp_http_client_handle_t client = esp_http_client_init(&s_config);
-
-    // Sets the content header to octet-stream as we are sending raw
-    // binary data
-    esp_http_client_set_header(client, "Content-Type", "application/octet-stream");
+    uplink_worker_t *worker = pvParameters;
+    uplink_client_t *uplink = &worker->uplink;
+
+    // The first worker also replays the spool, refreshes the
+    // shared gauges and sends the heartbeat
+    bool primary = worker->index == 0;
+
+    // Opens the persistent connection to the backend
+    ESP_ERROR_CHECK(uplink_client_init(uplink));
+
+    if (primary) {
+        // Finds the packets which could not be uploaded
+        // before the last reboot. Without a spool partition
+        // failed batches are dropped like before
+        if (spool_init() != ESP_OK) {
+            ESP_LOGW(TAG, "Spool not available, failed uploads will be dropped");
+        }
+        xEventGroupSetBits(s_network_events, SPOOL_READY_BIT);
+    }
 
-    // Create a struct for storing the lora packet
-    lora_packet_t packet;
+    // The client is ready, the requests need the wifi connection.
+    // Packets received meanwhile wait in the ingest queue
+    xEventGroupWaitBits(s_network_events, NETWORK_CONNECTED_BIT | SPOOL_READY_BIT, pdFALSE, pdTRUE, portMAX_DELAY);
+
+    // The batch which collects new packets
+    // and the batch which is being sent
+    uplink_batch_t *pending = &worker->batches[0];
+    uplink_batch_t *in_flight = &worker->batches[1];
+    uplink_batch_reset(pending);
+
+    // The batch of urgent packets, sent ahead of the pending
+    // batch, the spool and the heartbeat. While it is in flight
+    // the priority lane waits, its packets follow right after
+    uplink_batch_t *urgent = &worker->urgent;
+    uplink_batch_reset(urgent);
+    int64_t urgent_first_rx = 0;
+    bool in_flight_urgent = false;
+
+    // When the first packet of the pending batch arrived,
+    // and when the first packet of both batches was received
+    TickType_t batch_start = 0;
+    int64_t pending_first_rx = 0;
+    int64_t in_flight_first_rx = 0;
+
+    // Whether the last request reached the backend.
+    // Spooled packets are only replayed while it does
+    bool uplink_healthy = true;
+
+    // Set while the batch in flight was read from the spool
+    bool in_flight_spooled = false;
+    spool_cursor_t spool_cursor;
+    TickType_t last_drain = 0;
+
+    // Set while the request in flight is a heartbeat
+    bool in_flight_heartbeat = false;
+#if CONFIG_METRICS_HEARTBEAT_INTERVAL_SEC > 0
+    TickType_t last_heartbeat = xTaskGetTickCount();
+#endif
+    TickType_t last_gauges = 0;
+    TickType_t last_rx_report = xTaskGetTickCount();
+#if CONFIG_TASK_HEADROOM_REPORT_SEC > 0
+    bool headroom_reported = false;
+#endif
+    int64_t last_step_us = esp_timer_get_time();
+    worker->reported_at_us = last_step_us;
+
+    // Generation of the remote configuration the worker runs on
+    // and how long the pending batch may wait under it
+    uint32_t config_generation = 0;
+    remote_config_t config = {0};
+    TickType_t max_wait = pdMS_TO_TICKS(CONFIG_UPLINK_BATCH_MAX_WAIT_MS);
+
+    // Set while the backend host of a remote configuration
+    // has not answered yet. If it never does, the worker goes
+    // back to the firmware host instead of losing the backend
+    bool host_unconfirmed = false;
+
+    // Stores the index of the packet pool slot
+    // which holds the received lora packet
+    packet_slot_t slot;
 
     // Enter the task `body`
-    // continously runs checks whether there is data
-    // in the queue, then reads the packet from it
-    // and sends it to the server
+    // collects packets into the pending batch until it is
+    // full or the batch wait time runs out, then hands it
+    // to the uplink and starts a new pending batch.
+    // The request is driven step by step, in between the
+    // task sleeps on the queue so it never spins while the
+    // socket is not ready and keeps taking new packets
 
     while (1) {
-        BaseType_t status = xQueueReceive(s_lora_queue_handler, &packet, portMAX_DELAY);
-        
-        if (status == pdTRUE) {
-            https_async(client, &packet);
+        // Switches to a new remote configuration between requests,
+        // settings it leaves out go back to the firmware defaults
+        if (!uplink_busy(uplink) && remote_config_changed(&config_generation, &config)) {
+            bool remote_host = config.fields & REMOTE_CONFIG_HAS_UPLINK_HOST;
+            uplink_configure(uplink, remote_host ? config.uplink_host : NULL, config.uplink_timeout_ms, config.version);
+            uplink_batch_set_limit(config.batch_max_packets);
+            max_wait = pdMS_TO_TICKS(config.batch_max_wait_ms > 0 ? config.batch_max_wait_ms : CONFIG_UPLINK_BATCH_MAX_WAIT_MS);
+            host_unconfirmed = remote_host;
+        }
+
+        TickType_t waited = xTaskGetTickCount() - batch_start;
+        bool batch_ready = pending->count > 0 && (uplink_batch_full(pending) || waited >= max_wait);
+
+        // Decides how long to wait for the next packet
+        TickType_t wait;
+        if (uplink_busy(uplink)) {
+            wait = pdMS_TO_TICKS(CONFIG_UPLINK_POLL_INTERVAL_MS);
+        } else if (batch_ready || urgent->count > 0) {
+            wait = 0;
+        } else if (pending->count > 0) {
+            wait = max_wait - waited;
+        } else if (primary && uplink_healthy && !spool_empty()) {
+            // Wakes up for the next spool drain
+            TickType_t since_drain = xTaskGetTickCount() - last_drain;
+            TickType_t drain_interval = pdMS_TO_TICKS(CONFIG_SPOOL_DRAIN_INTERVAL_MS);
+            wait = since_drain >= drain_interval ? 0 : drain_interval - since_drain;
+        } else {
+            // Wakes up now and then to refresh the gauges
+            // and send the heartbeat
+            wait = pdMS_TO_TICKS(METRICS_GAUGE_INTERVAL_MS);
         }
+
+        // Takes packets from the lanes whose batch has room,
+        // the others stay in the ingest queue until their
+        // request is done
+        uint8_t lanes = 0;
+        if (!in_flight_urgent && !uplink_batch_full(urgent)) {
+            lanes |= BIT(INGEST_LANE_PRIORITY);
+        }
+        if (!uplink_batch_full(pending)) {
+            lanes |= BIT(INGEST_LANE_BULK);
+        }
+
+        ingest_lane_t lane;
+        if (lanes == 0) {
+            if (wait > 0) {
+                vTaskDelay(wait);
+            }
+        } else if (ingest_pop(&s_lora_queue, worker->index, lanes, &slot, &lane, wait)) {
+            lora_packet_t *packet = packet_pool_get(slot);
+
+            if (lane == INGEST_LANE_PRIORITY) {
+                if (urgent->count == 0) {
+                    urgent_first_rx = packet->rx_timestamp;
+                }
+                uplink_batch_add(urgent, packet);
+            } else {
+                if (pending->count == 0) {
+                    batch_start = xTaskGetTickCount();
+                    pending_first_rx = packet->rx_timestamp;
+                }
+                uplink_batch_add(pending, packet);
+            }
+
+            // The packet is copied into the batch body
+            // so the slot is handed back to the receive task right away
+            packet_pool_release(slot);
+        }
+
+        // Counts the time since the last step as busy
+        // when a request was outstanding during it
+        int64_t now_us = esp_timer_get_time();
+        if (uplink_busy(uplink)) {
+            worker->busy_us += now_us - last_step_us;
+        }
+        last_step_us = now_us;
+
+        // Drives the request in flight one step further
+        uplink_result_t result = uplink_poll(uplink);
+        if (result == UPLINK_RESULT_DONE) {
+            if (!__atomic_exchange_n(&s_first_upload_done, true, __ATOMIC_RELAXED)) {
+                boot_phase_reached("first upload");
+            }
+
+            uplink_healthy = true;
+            host_unconfirmed = false;
+
+            // A newer configuration comes along with the reply, the
+            // receive task reprograms the radio at the next packet boundary
+            const uplink_reply_t *reply = &uplink->reply;
+            if (reply->valid && (reply->flags & UPLINK_REPLY_FLAG_CONFIG) &&
+                remote_config_update(reply->config_version, reply->config, reply->config_length) == ESP_OK) {
+                xTaskNotifyGive(s_lora_rx_task);
+            }
+
+            if (in_flight_spooled) {
+                spool_consume(&spool_cursor);
+            } else if (in_flight_urgent) {
+                metrics_record(METRIC_HIST_PRIORITY_DELIVERY_MS, (esp_timer_get_time() - urgent_first_rx) / 1000);
+            } else if (!in_flight_heartbeat) {
+                metrics_record(METRIC_HIST_DELIVERY_MS, (esp_timer_get_time() - in_flight_first_rx) / 1000);
+            }
+            in_flight_heartbeat = false;
+        } else if (result == UPLINK_RESULT_FAILED) {
+            uplink_healthy = false;
+
+            // Keeps the packets on flash until the backend
+            // is reachable again. Spooled batches are still there
+            // and a lost heartbeat is replaced by the next one
+            if (in_flight_heartbeat) {
+                in_flight_heartbeat = false;
+            } else if (in_flight_urgent) {
+                if (spool_append_batch(urgent) != ESP_OK) {
+                    trace_event(TRACE_BATCH_DROPPED, urgent->count, 0);
+                }
+            } else if (!in_flight_spooled && spool_append_batch(in_flight) != ESP_OK) {
+                trace_event(TRACE_BATCH_DROPPED, in_flight->count, 0);
+            }
+
+            if (host_unconfirmed) {
+                ESP_LOGW(TAG, "Configured backend host unreachable, going back to the default");
+                uplink_configure(uplink, NULL, config.uplink_timeout_ms, config.version);
+                host_unconfirmed = false;
+            }
+        } else if (result == UPLINK_RESULT_REJECTED) {
+            // Sending the batch again would be refused again,
+            // a spooled one is consumed so it does not hold up
+            // the records behind it
+            uplink_batch_t *rejected = in_flight_urgent ? urgent : in_flight;
+            if (in_flight_heartbeat) {
+                in_flight_heartbeat = false;
+            } else {
+                if (in_flight_spooled) {
+                    spool_consume(&spool_cursor);
+                }
+                metrics_add(METRIC_UPLOAD_DROPPED, rejected->count);
+                trace_event(TRACE_BATCH_DROPPED, rejected->count, 0);
+            }
+
+            // A configured host which refuses the first request
+            // is no better than one which never answers
+            if (host_unconfirmed) {
+                ESP_LOGW(TAG, "Configured backend host rejected the upload, going back to the default");
+                uplink_configure(uplink, NULL, config.uplink_timeout_ms, config.version);
+                host_unconfirmed = false;
+            }
+        }
+
+        // The urgent batch is done either way, the
+        // priority lane refills it from now on
+        if (in_flight_urgent &&
+            (result == UPLINK_RESULT_DONE || result == UPLINK_RESULT_FAILED || result == UPLINK_RESULT_REJECTED)) {
+            uplink_batch_reset(urgent);
+            in_flight_urgent = false;
+        }
+
+        // Urgent packets go out as soon as the uplink is free,
+        // whatever the pending batch or the spool hold
+        if (!uplink_busy(uplink) && urgent->count > 0) {
+            in_flight_urgent = true;
+            in_flight_spooled = false;
+            start_batch_upload(worker, urgent);
+        }
+
+        // While the backend is unreachable a full pending batch
+        // goes straight to the spool instead of holding up the queue
+        if (!uplink_healthy && uplink_busy(uplink) && uplink_batch_full(pending)) {
+            if (spool_append_batch(pending) != ESP_OK) {
+                trace_event(TRACE_BATCH_DROPPED, pending->count, 0);
+            }
+            uplink_batch_reset(pending);
+        }
+
+        // Sends the pending batch once the uplink is free
+        waited = xTaskGetTickCount() - batch_start;
+        batch_ready = pending->count > 0 && (uplink_batch_full(pending) || waited >= max_wait);
+        if (!uplink_busy(uplink) && batch_ready) {
+            uplink_batch_t *batch = in_flight;
+            in_flight = pending;
+            pending = batch;
+            uplink_batch_reset(pending);
+
+            in_flight_spooled = false;
+            in_flight_first_rx = pending_first_rx;
+            start_batch_upload(worker, in_flight);
+        }
+
+        // Replays spooled packets when the uplink has nothing else
+        // to do, at most one batch per drain interval so live
+        // traffic keeps the priority. Only one worker drains,
+        // the spool hands out its records in order
+        if (primary && !uplink_busy(uplink) && uplink_healthy && pending->count == 0 && !spool_empty() &&
+            xTaskGetTickCount() - last_drain >= pdMS_TO_TICKS(CONFIG_SPOOL_DRAIN_INTERVAL_MS)) {
+            uplink_batch_reset(in_flight);
+            if (spool_read_batch(in_flight, CONFIG_SPOOL_DRAIN_BATCH, &spool_cursor) > 0) {
+                in_flight_spooled = true;
+                last_drain = xTaskGetTickCount();
+                start_batch_upload(worker, in_flight);
+            }
+        }
+
+        if (xTaskGetTickCount() - last_gauges >= pdMS_TO_TICKS(METRICS_GAUGE_INTERVAL_MS)) {
+            if (primary) {
+                update_gauges();
+            }
+            update_worker_gauge(worker);
+            last_gauges = xTaskGetTickCount();
+        }
+
+        if (primary && rx_scheduler_active() &&
+            xTaskGetTickCount() - last_rx_report >= pdMS_TO_TICKS(RX_SCHEDULER_REPORT_INTERVAL_MS)) {
+            rx_scheduler_report();
+            last_rx_report = xTaskGetTickCount();
+        }
+
+#if CONFIG_TASK_HEADROOM_REPORT_SEC > 0
+        if (primary && !headroom_reported && esp_timer_get_time() >= CONFIG_TASK_HEADROOM_REPORT_SEC * 1000000LL) {
+            report_headroom();
+            headroom_reported = true;
+        }
+#endif
+
+#if CONFIG_METRICS_HEARTBEAT_INTERVAL_SEC > 0
+        // Reports the metrics to the backend when there is
+        // nothing else to send. The batch buffers stay untouched
+        if (primary && !uplink_busy(uplink) && pending->count == 0 &&
+            xTaskGetTickCount() - last_heartbeat >= pdMS_TO_TICKS(CONFIG_METRICS_HEARTBEAT_INTERVAL_SEC * 1000)) {
+            metrics_snapshot_t snapshot;
+            metrics_snapshot(&snapshot);
+            size_t length = metrics_encode(&snapshot, s_heartbeat_body, sizeof(s_heartbeat_body));
+
+            in_flight_heartbeat = true;
+            last_heartbeat = xTaskGetTickCount();
+            uplink_start_heartbeat(uplink, s_heartbeat_body, length);
+        }
+#endif
     }
 
     // Cleanup of the client which closes some connections 
     // and frees resources
-    esp_http_client_cleanup(client);
+    esp_http_client_cleanup(uplink->client);
 
     // Removes the task (not necessary)
     vTaskDelete(NULL);
 }
 
 void lora_receive_task(void *pvParameters) {
-    // Stores the payload of the recevied packet
-    uint8_t *recv_buffer = malloc(256);
+    // Asks the radio to notify this task on every received packet.
+    // Falls back to polling the radio when the interrupt is not available
+    bool interrupt_mode = lora_enable_rx_interrupt(xTaskGetCurrentTaskHandle());
+    ESP_LOGI(TAG, "LoRa receive mode: %s", interrupt_mode ? "DIO0 interrupt" : "polling");
+
+    // The radio listens from here on, with several spreading
+    // factors the scheduler already started a detection
+    if (!rx_scheduler_active()) {
+        lora_receive();
+    }
+    boot_phase_reached("radio ready");
+    bool first_packet = true;
+
+    // How long until the pending acks are due
+    TickType_t ack_wait = portMAX_DELAY;
+    // How long until the receive scheduler moves on
+    TickType_t sched_wait = portMAX_DELAY;
 
-    // Creates a lora packet
-    lora_packet_t packet = {
-        .payload = recv_buffer,
-        .payload_size = 256};
+    // Generation of the remote configuration the radio runs on,
+    // and whether a newer one waits for a packet boundary
+    uint32_t config_generation = 0;
+    remote_config_t config = {0};
+    bool config_pending = false;
 
     while (true) {
-        // Continously puts the LoRa radio into receive mode
-        lora_receive();
+        // Continously puts the LoRa radio into receive mode,
+        // unless an ack frame is on the air or the scheduler
+        // decides when to receive on which profile
+        if (!lora_tx_busy() && !rx_scheduler_active()) {
+            lora_receive();
+        }
+
+        // Sleeps until the DIO0 interrupt reports a received packet,
+        // the end of a transmission or of a channel activity detection,
+        // or the next acks are due
+        if (interrupt_mode) {
+            ulTaskNotifyTake(pdTRUE, MIN(MIN(pdMS_TO_TICKS(LORA_RX_INTERRUPT_TIMEOUT_MS), ack_wait), sched_wait));
+        }
+
+        // Returns the radio to receive mode once
+        // the ack frame is sent
+        lora_tx_poll();
 
         // Checks if some data is available (was recevied)
         // and the radio is ready to send it to us
 
-        while (lora_received()) {
+        while (!lora_tx_busy() && lora_received()) {
+            // Takes ownership of a free packet slot
+            packet_slot_t slot = packet_pool_acquire();
+
+            if (slot == PACKET_POOL_INVALID_SLOT) {
+                // Every slot is waiting to be uploaded.
+                // Clears the receive flags without reading
+                // the FIFO and drops the packet
+                trace_event(TRACE_POOL_EXHAUSTED, 0, 0);
+                metrics_count(METRIC_RX_POOL_EXHAUSTED);
+                lora_receive_packet(NULL, 0);
+                lora_receive();
+                continue;
+            }
+
             // Populate the packet struct with actual received packet data
-            packet.payload_size = lora_receive_packet(packet.payload, 256);
+            lora_packet_t *packet = packet_pool_get(slot);
+            packet->payload_size = lora_receive_packet(packet->payload, LORA_MAX_PACKET_SIZE);
+            // Stamped with its RxDone interrupt, or the current time
+            // when the task woke up on the timeout or another event
+            packet->rx_timestamp = interrupt_mode ? lora_last_irq_time() : esp_timer_get_time();
+
+            // Packets which failed the CRC check are empty
+            if (packet->payload_size == 0) {
+                metrics_count(METRIC_RX_CRC_ERRORS);
+                packet_pool_release(slot);
+                lora_receive();
+                continue;
+            }
+
+            metrics_count(METRIC_RX_PACKETS);
+            rx_scheduler_packet();
 
-            // Create the lora packet header 
-            lora_header_t header = {
-                .node_id = *((uint32_t *)packet.payload),
-                .message_id = *(((uint32_t *)packet.payload) + 1)
-            };
+            // Reads the link quality before the radio
+            // goes back to receive mode and overwrites it
+            lora_read_packet_meta(&packet->meta);
+
+            if (first_packet) {
+                boot_phase_reached("first packet");
+                first_packet = false;
+            }
 
-            // Check if the packet is already contained in the
-            // history buffer
+            // Parses the lora packet header and drops frames
+            // which are too short, come from unknown nodes or
+            // fail the authentication before they take up a
+            // queue entry, an ack or uplink bandwidth
+            lora_header_t header;
+            if (rx_filter_check(packet, &header) != RX_FILTER_ACCEPT) {
+                packet_pool_release(slot);
+                lora_receive();
+                continue;
+            }
+
+            // Check if the packet was already seen within the
+            // deduplication window (relay nodes may see each other)
+            // and remember it for the packets that follow.
             // Send it if it is not duplicate otherwise ignore
 
-            if(lora_packet_is_duplicate(header) == 0) {
-                // Adds the packet the the queue
-                xQueueSend(s_lora_queue_handler, &packet, portMAX_DELAY);
+#if CONFIG_LORA_ACK
+            // Duplicates are acked as well, the sender
+            // retransmits because it missed the last ack
+            ack_schedule(header, rx_scheduler_current(), packet->rx_timestamp);
+#endif
+
+            if (!dedup_check_and_insert(header, packet->rx_timestamp)) {
+                // Hands the slot over to the uplink worker of the
+                // node which releases it after the upload.
+                // Never blocks, if the queue is full the overflow
+                // policy drops a packet instead of stalling the radio
+                ingest_push(&s_lora_queue, rx_filter_lane(&header), slot, header.node_id);
+            } else {
+                metrics_count(METRIC_RX_DUPLICATES);
+                packet_pool_release(slot);
             }
 
-            // Adds the header to the deduplication queue
-            // AKA history queue
-            lora_add_to_history(header);
             lora_receive();
         }
-        vTaskDelay(1);
+
+        // Reprograms the modem for a new remote configuration
+        // between packets, not while an ack frame is on the air
+        // or the modem is locked on a packet. Only the modem
+        // registers change, the radio is not reset
+        if (remote_config_changed(&config_generation, &config)) {
+            config_pending = true;
+        }
+        if (config_pending && !lora_tx_busy() && !lora_rx_in_progress() && !lora_received()) {
+            lora_modem_profile_t profile;
+            uint8_t spreading_factors[RX_SCHEDULER_MAX_PROFILES];
+            int count;
+            rx_scheduler_get_defaults(&profile, spreading_factors, &count);
+            remote_config_radio(&config, &profile, spreading_factors, &count);
+            if (rx_scheduler_configure(&profile, spreading_factors, count) != ESP_OK) {
+                ESP_LOGE(TAG, "Radio configuration %" PRIu32 " not applied", config.version);
+            }
+            if (!rx_scheduler_active()) {
+                lora_receive();
+            }
+            config_pending = false;
+        }
+
+#if CONFIG_LORA_ACK
+        // Sends the acks right from this task, the radio is
+        // back in receive mode as soon as the frame is out
+        ack_wait = ack_poll(esp_timer_get_time());
+#endif
+
+        // Detects activity on the next profile or stays on the
+        // current one, the radio waits while an ack frame is out
+        if (!lora_tx_busy()) {
+            sched_wait = rx_scheduler_poll(esp_timer_get_time());
+        }
+
+        if (!interrupt_mode) {
+            vTaskDelay(1);
+        }
     }
 }
 
@@ -285,31 +738,93 @@ void app_main(void) {
 
     ESP_ERROR_CHECK(esp_event_loop_create_default());
 
+    // Starts the trace log before any task can write to it
+    ESP_ERROR_CHECK(trace_init());
+
     // Initializes the lora driver
     // and configures sensible defaults
     // to achieve a balanced ratio betweeen
     // range, speed and power consumption
     ESP_ERROR_CHECK(lora_initialize_radio());
 
+    // Picks the spreading factors to receive on, the radio
+    // cycles through them when there is more than one
+    ESP_ERROR_CHECK(rx_scheduler_init());
+
+    // Preallocates the slots which hold the received
+    // lora packets until they are uploaded
+    ESP_ERROR_CHECK(packet_pool_init());
+
+    // Clears the table of recently seen packets
+    ESP_ERROR_CHECK(dedup_init());
+
+    // Loads the node allowlist and the authentication key
+    ESP_ERROR_CHECK(rx_filter_init());
+
+    // Counts the boot, the receive times in the
+    // batches are relative to it
+    ESP_ERROR_CHECK(uplink_batch_init());
+
+    // Loads the configuration the backend sent before the
+    // last reboot, the radio and the uplinks switch to it
+    // as soon as their tasks start
+    ESP_ERROR_CHECK(remote_config_init());
+
+#if CONFIG_LORA_ACK
+    // Starts without pending acks
+    ESP_ERROR_CHECK(ack_init());
+#endif
+
     // Creates a queue for the received lora packets
-    s_lora_queue_handler = xQueueCreate(1, sizeof(lora_packet_t));
+    ESP_ERROR_CHECK(ingest_init(&s_lora_queue, INGEST_OVERFLOW_POLICY, CONFIG_UPLINK_WORKERS));
+    ESP_ERROR_CHECK(ingest_init_lane(&s_lora_queue, INGEST_LANE_BULK, s_lora_queue_storage, CONFIG_INGEST_QUEUE_DEPTH));
+    ESP_ERROR_CHECK(ingest_init_lane(&s_lora_queue, INGEST_LANE_PRIORITY, s_lora_priority_storage, CONFIG_INGEST_PRIORITY_DEPTH));
 
-    // Connects to the wifi network
-    // using an ESP IDF provided example
-    ESP_ERROR_CHECK(example_connect());
-    ESP_LOGI(TAG, "Connected to AP, begin http");
+#if CONFIG_IDF_TARGET_LINUX
+    // Starts the local sink which stands in for the backend
+    // and the periodic report of the pipeline benchmark
+    ESP_ERROR_CHECK(bench_start(&s_lora_queue));
+#endif
+
+    s_network_events = xEventGroupCreate();
 
     // Creates a lora receive task which
     // lora the lora radio for a new lora packet
     // and upon receiving it, adds it to the queue
-    // for further processing
-    xTaskCreate(&lora_receive_task, "lora_receive_task", 8192, NULL, 5, NULL);
+    // for further processing.
+    // Starts before the wifi connection so no packet
+    // is lost while the access point is associating
+    xTaskCreatePinnedToCore(&lora_receive_task, "lora_receive_task", CONFIG_LORA_RX_TASK_STACK_SIZE, NULL,
+                            CONFIG_LORA_RX_TASK_PRIORITY, &s_lora_rx_task, LORA_RX_TASK_CORE);
 
-    // The http transmit task which listens for data
+    // The http transmit tasks which listen for data
     // in the lora packet queue
-    // and sends the packets to a defined
-    // web server
-    xTaskCreate(&http_transmit_task, "http_transmit_task", 8192, NULL, 5, NULL);
+    // and send the packets to a defined
+    // web server, one per uplink worker.
+    // Set up the clients and the spool while the
+    // wifi connection is being established
+    for (int i = 0; i < CONFIG_UPLINK_WORKERS; i++) {
+        char name[configMAX_TASK_NAME_LEN];
+        snprintf(name, sizeof(name), "uplink_%d", i);
+        s_uplink_workers[i].index = i;
+        xTaskCreatePinnedToCore(&http_transmit_task, name, CONFIG_UPLINK_WORKER_STACK_SIZE, &s_uplink_workers[i],
+                                CONFIG_UPLINK_WORKER_PRIORITY, &s_uplink_workers[i].task, UPLINK_WORKER_CORE);
+    }
+
+    // Connects to the wifi network
+    // using an ESP IDF provided example
+    ESP_ERROR_CHECK(example_connect());
+    ESP_LOGI(TAG, "Connected to AP, begin http");
+    boot_phase_reached("wifi connected");
+    xEventGroupSetBits(s_network_events, NETWORK_CONNECTED_BIT);
+
+#if CONFIG_METRICS_HTTP_SERVER
+    // Serves the metrics on the local network
+    if (metrics_start_server() != ESP_OK) {
+        ESP_LOGW(TAG, "Stats endpoint not available");
+    }
+#endif
 
-    // NOTE: The tasks have the same priority
+    // NOTE: The radio task runs above the uplink workers,
+    // see LORA_RX_TASK_PRIORITY and UPLINK_WORKER_PRIORITY
 }
@@ -0,0 +1,255 @@
+#include <stdio.h>
+#include <string.h>
+#include "esp_log.h"
+#include "esp_cpu.h"
+#include "esp_timer.h"
+#include "freertos/FreeRTOS.h"
+#include "metrics.h"
+#if CONFIG_METRICS_HTTP_SERVER
+#include "esp_http_server.h"
+#endif
+
+// Every core records into its own row with relaxed atomic adds,
+// so recording never takes a lock or disables interrupts and
+// the cores do not fight over the same cache lines.
+// Readers sum the rows, a snapshot may be a few events off
+// between counters but never loses one
+typedef struct
+{
+    uint32_t counters[METRIC_COUNTER_COUNT];
+    metrics_histogram_t histograms[METRIC_HIST_COUNT];
+} __attribute__((aligned(32))) metrics_core_t;
+
+static metrics_core_t s_metrics_cores[portNUM_PROCESSORS];
+static uint32_t s_metrics_gauges[METRIC_GAUGE_COUNT];
+
+static inline metrics_core_t *metrics_core(void) {
+    return &s_metrics_cores[esp_cpu_get_core_id()];
+}
+
+void metrics_add(metric_counter_t counter, uint32_t value) {
+    __atomic_fetch_add(&metrics_core()->counters[counter], value, __ATOMIC_RELAXED);
+}
+
+void metrics_count(metric_counter_t counter) {
+    metrics_add(counter, 1);
+}
+
+void metrics_count_http_status(int status) {
+    if (status >= 200 && status < 600) {
+        metrics_count(METRIC_HTTP_2XX + status / 100 - 2);
+    }
+}
+
+void metrics_gauge(metric_gauge_t gauge, uint32_t value) {
+    __atomic_store_n(&s_metrics_gauges[gauge], value, __ATOMIC_RELAXED);
+}
+
+void metrics_record(metric_histogram_t histogram, uint32_t value_ms) {
+    metrics_histogram_t *h = &metrics_core()->histograms[histogram];
+
+    // Index of the highest set bit, values of 0 ms land in the first bucket
+    int bucket = value_ms == 0 ? 0 : 32 - __builtin_clz(value_ms);
+    if (bucket >= METRICS_HISTOGRAM_BUCKETS) {
+        bucket = METRICS_HISTOGRAM_BUCKETS - 1;
+    }
+
+    __atomic_fetch_add(&h->buckets[bucket], 1, __ATOMIC_RELAXED);
+    __atomic_fetch_add(&h->count, 1, __ATOMIC_RELAXED);
+    __atomic_fetch_add(&h->sum_ms, value_ms, __ATOMIC_RELAXED);
+}
+
+void metrics_snapshot(metrics_snapshot_t *snapshot) {
+    memset(snapshot, 0, sizeof(*snapshot));
+
+    for (int core = 0; core < portNUM_PROCESSORS; core++) {
+        const metrics_core_t *row = &s_metrics_cores[core];
+
+        for (int i = 0; i < METRIC_COUNTER_COUNT; i++) {
+            snapshot->counters[i] += __atomic_load_n(&row->counters[i], __ATOMIC_RELAXED);
+        }
+
+        for (int i = 0; i < METRIC_HIST_COUNT; i++) {
+            for (int b = 0; b < METRICS_HISTOGRAM_BUCKETS; b++) {
+                snapshot->histograms[i].buckets[b] += __atomic_load_n(&row->histograms[i].buckets[b], __ATOMIC_RELAXED);
+            }
+            snapshot->histograms[i].count += __atomic_load_n(&row->histograms[i].count, __ATOMIC_RELAXED);
+            snapshot->histograms[i].sum_ms += __atomic_load_n(&row->histograms[i].sum_ms, __ATOMIC_RELAXED);
+        }
+    }
+
+    for (int i = 0; i < METRIC_GAUGE_COUNT; i++) {
+        snapshot->gauges[i] = __atomic_load_n(&s_metrics_gauges[i], __ATOMIC_RELAXED);
+    }
+}
+
+static uint8_t *metrics_put_u32(uint8_t *out, uint32_t value) {
+    out[0] = (uint8_t)(value & 0xff);
+    out[1] = (uint8_t)((value >> 8) & 0xff);
+    out[2] = (uint8_t)((value >> 16) & 0xff);
+    out[3] = (uint8_t)(value >> 24);
+    return out + 4;
+}
+
+// Heartbeat body, all fields little endian:
+//   uint8_t  version
+//   uint32_t uptime in seconds
+//   uint8_t  counter count, uint32_t counters[]
+//   uint8_t  gauge count, uint32_t gauges[]
+//   uint8_t  histogram count
+//   uint8_t  buckets per histogram
+//   per histogram: uint32_t count, uint32_t sum in ms, uint32_t buckets[]
+// New metrics are appended, so older backends can skip what they do not know
+size_t metrics_encode(const metrics_snapshot_t *snapshot, uint8_t *buffer, size_t size) {
+    if (size < METRICS_HEARTBEAT_SIZE) {
+        return 0;
+    }
+
+    uint8_t *out = buffer;
+    *out++ = METRICS_HEARTBEAT_VERSION;
+    out = metrics_put_u32(out, (uint32_t)(esp_timer_get_time() / 1000000));
+
+    *out++ = METRIC_COUNTER_COUNT;
+    for (int i = 0; i < METRIC_COUNTER_COUNT; i++) {
+        out = metrics_put_u32(out, snapshot->counters[i]);
+    }
+
+    *out++ = METRIC_GAUGE_COUNT;
+    for (int i = 0; i < METRIC_GAUGE_COUNT; i++) {
+        out = metrics_put_u32(out, snapshot->gauges[i]);
+    }
+
+    *out++ = METRIC_HIST_COUNT;
+    *out++ = METRICS_HISTOGRAM_BUCKETS;
+    for (int i = 0; i < METRIC_HIST_COUNT; i++) {
+        out = metrics_put_u32(out, snapshot->histograms[i].count);
+        out = metrics_put_u32(out, snapshot->histograms[i].sum_ms);
+        for (int b = 0; b < METRICS_HISTOGRAM_BUCKETS; b++) {
+            out = metrics_put_u32(out, snapshot->histograms[i].buckets[b]);
+        }
+    }
+
+    return out - buffer;
+}
+
+#if CONFIG_METRICS_HTTP_SERVER
+// Log tag
+static const char *TAG = "METRICS";
+
+static const char *const s_metrics_counter_names[METRIC_COUNTER_COUNT] = {
+    [METRIC_RX_PACKETS] = "rx_packets",
+    [METRIC_RX_CRC_ERRORS] = "rx_crc_errors",
+    [METRIC_RX_DUPLICATES] = "rx_duplicates",
+    [METRIC_RX_POOL_EXHAUSTED] = "rx_pool_exhausted",
+    [METRIC_UPLOAD_REQUESTS] = "upload_requests",
+    [METRIC_UPLOAD_FRAMES] = "upload_frames",
+    [METRIC_UPLOAD_FAILURES] = "upload_failures",
+    [METRIC_HTTP_2XX] = "http_2xx",
+    [METRIC_HTTP_3XX] = "http_3xx",
+    [METRIC_HTTP_4XX] = "http_4xx",
+    [METRIC_HTTP_5XX] = "http_5xx",
+    [METRIC_CODEC_BYTES_IN] = "codec_bytes_in",
+    [METRIC_CODEC_BYTES_OUT] = "codec_bytes_out",
+    [METRIC_CODEC_TIME_US] = "codec_time_us",
+    [METRIC_ACK_FRAMES] = "ack_frames",
+    [METRIC_ACKS_SENT] = "acks_sent",
+    [METRIC_ACK_DROPPED] = "ack_dropped",
+    [METRIC_RX_REJECT_SHORT] = "rx_reject_short",
+    [METRIC_RX_REJECT_NODE] = "rx_reject_node",
+    [METRIC_RX_REJECT_TAG] = "rx_reject_tag",
+    [METRIC_CONFIG_APPLIED] = "config_applied",
+    [METRIC_CONFIG_REJECTED] = "config_rejected",
+    [METRIC_UPLOAD_DROPPED] = "upload_dropped",
+};
+
+static const char *const s_metrics_gauge_names[METRIC_GAUGE_COUNT] = {
+    [METRIC_GAUGE_QUEUE_DEPTH] = "queue_depth",
+    [METRIC_GAUGE_POOL_IN_USE] = "pool_in_use",
+    [METRIC_GAUGE_SPOOL_RECORDS] = "spool_records",
+    [METRIC_GAUGE_UPLINK0_BUSY_PCT] = "uplink0_busy_pct",
+    [METRIC_GAUGE_UPLINK1_BUSY_PCT] = "uplink1_busy_pct",
+    [METRIC_GAUGE_UPLINK2_BUSY_PCT] = "uplink2_busy_pct",
+    [METRIC_GAUGE_UPLINK3_BUSY_PCT] = "uplink3_busy_pct",
+    [METRIC_GAUGE_CONFIG_VERSION] = "config_version",
+};
+
+static const char *const s_metrics_histogram_names[METRIC_HIST_COUNT] = {
+    [METRIC_HIST_UPLOAD_MS] = "upload_ms",
+    [METRIC_HIST_DELIVERY_MS] = "delivery_ms",
+    [METRIC_HIST_PRIORITY_DELIVERY_MS] = "priority_delivery_ms",
+};
+
+// Writes the snapshot as a small JSON document
+static int metrics_format_json(const metrics_snapshot_t *snapshot, char *buffer, size_t size) {
+    size_t n = snprintf(buffer, size, "{\"uptime_sec\":%lu", (unsigned long)(esp_timer_get_time() / 1000000));
+
+    for (int i = 0; i < METRIC_COUNTER_COUNT && n < size; i++) {
+        n += snprintf(buffer + n, size - n, ",\"%s\":%lu", s_metrics_counter_names[i], (unsigned long)snapshot->counters[i]);
+    }
+
+    for (int i = 0; i < METRIC_GAUGE_COUNT && n < size; i++) {
+        n += snprintf(buffer + n, size - n, ",\"%s\":%lu", s_metrics_gauge_names[i], (unsigned long)snapshot->gauges[i]);
+    }
+
+    for (int i = 0; i < METRIC_HIST_COUNT && n < size; i++) {
+        const metrics_histogram_t *h = &snapshot->histograms[i];
+        n += snprintf(buffer + n, size - n, ",\"%s\":{\"count\":%lu,\"sum\":%lu,\"buckets\":[",
+                      s_metrics_histogram_names[i], (unsigned long)h->count, (unsigned long)h->sum_ms);
+        for (int b = 0; b < METRICS_HISTOGRAM_BUCKETS && n < size; b++) {
+            n += snprintf(buffer + n, size - n, "%s%lu", b > 0 ? "," : "", (unsigned long)h->buckets[b]);
+        }
+        if (n < size) {
+            n += snprintf(buffer + n, size - n, "]}");
+        }
+    }
+
+    if (n < size) {
+        n += snprintf(buffer + n, size - n, "}");
+    }
+
+    return n < size ? (int)n : -1;
+}
+
+static esp_err_t metrics_stats_handler(httpd_req_t *req) {
+    static char buffer[2048];
+    metrics_snapshot_t snapshot;
+
+    metrics_snapshot(&snapshot);
+    int length = metrics_format_json(&snapshot, buffer, sizeof(buffer));
+    if (length < 0) {
+        return httpd_resp_send_500(req);
+    }
+
+    httpd_resp_set_type(req, "application/json");
+    return httpd_resp_send(req, buffer, length);
+}
+#endif
+
+esp_err_t metrics_start_server(void) {
+#if CONFIG_METRICS_HTTP_SERVER
+    httpd_handle_t server = NULL;
+    httpd_config_t config = HTTPD_DEFAULT_CONFIG();
+    config.server_port = CONFIG_METRICS_HTTP_PORT;
+    // One request at a time is plenty for a stats page
+    config.max_open_sockets = 2;
+    config.stack_size = 3072;
+
+    esp_err_t err = httpd_start(&server, &config);
+    if (err != ESP_OK) {
+        return err;
+    }
+
+    static const httpd_uri_t stats = {
+        .uri = "/stats",
+        .method = HTTP_GET,
+        .handler = metrics_stats_handler,
+    };
+    err = httpd_register_uri_handler(server, &stats);
+    if (err == ESP_OK) {
+        ESP_LOGI(TAG, "Stats on port %d at /stats", CONFIG_METRICS_HTTP_PORT);
+    }
+    return err;
+#else
+    return ESP_ERR_NOT_SUPPORTED;
+#endif
+}
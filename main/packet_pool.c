@@ -0,0 +1,86 @@
+#include "packet_pool.h"
+#include "freertos/FreeRTOS.h"
+#include "freertos/queue.h"
+
+// The packet slots themselves. They are allocated once
+// at compile time so receiving a packet never touches the heap
+static lora_packet_t s_packet_pool_slots[CONFIG_PACKET_POOL_SIZE];
+
+// Queue of free slot indices. Taking an index from it
+// transfers the ownership of the slot to the caller
+static QueueHandle_t s_packet_pool_free;
+static StaticQueue_t s_packet_pool_free_queue;
+static uint8_t s_packet_pool_free_storage[CONFIG_PACKET_POOL_SIZE * sizeof(packet_slot_t)];
+
+// Usage counters, guarded by the spinlock below
+static packet_pool_stats_t s_packet_pool_stats;
+static portMUX_TYPE s_packet_pool_lock = portMUX_INITIALIZER_UNLOCKED;
+
+esp_err_t packet_pool_init(void) {
+    s_packet_pool_free = xQueueCreateStatic(CONFIG_PACKET_POOL_SIZE, sizeof(packet_slot_t),
+                                            s_packet_pool_free_storage, &s_packet_pool_free_queue);
+    if (s_packet_pool_free == NULL) {
+        return ESP_FAIL;
+    }
+
+    // Every slot starts out free
+    for (packet_slot_t slot = 0; slot < CONFIG_PACKET_POOL_SIZE; slot++) {
+        xQueueSend(s_packet_pool_free, &slot, 0);
+    }
+
+    s_packet_pool_stats = (packet_pool_stats_t){
+        .capacity = CONFIG_PACKET_POOL_SIZE,
+    };
+
+    return ESP_OK;
+}
+
+packet_slot_t packet_pool_acquire(void) {
+    packet_slot_t slot;
+
+    // Never blocks, the caller decides what to do
+    // with the packet when the pool is exhausted
+    if (xQueueReceive(s_packet_pool_free, &slot, 0) != pdTRUE) {
+        portENTER_CRITICAL(&s_packet_pool_lock);
+        s_packet_pool_stats.exhausted++;
+        portEXIT_CRITICAL(&s_packet_pool_lock);
+        return PACKET_POOL_INVALID_SLOT;
+    }
+
+    portENTER_CRITICAL(&s_packet_pool_lock);
+    s_packet_pool_stats.in_use++;
+    if (s_packet_pool_stats.in_use > s_packet_pool_stats.high_water) {
+        s_packet_pool_stats.high_water = s_packet_pool_stats.in_use;
+    }
+    portEXIT_CRITICAL(&s_packet_pool_lock);
+
+    s_packet_pool_slots[slot].payload_size = 0;
+    return slot;
+}
+
+void packet_pool_release(packet_slot_t slot) {
+    if (slot >= CONFIG_PACKET_POOL_SIZE) {
+        return;
+    }
+
+    portENTER_CRITICAL(&s_packet_pool_lock);
+    s_packet_pool_stats.in_use--;
+    portEXIT_CRITICAL(&s_packet_pool_lock);
+
+    // The free queue is as deep as the pool so this can not fail
+    xQueueSend(s_packet_pool_free, &slot, 0);
+}
+
+lora_packet_t *packet_pool_get(packet_slot_t slot) {
+    if (slot >= CONFIG_PACKET_POOL_SIZE) {
+        return NULL;
+    }
+
+    return &s_packet_pool_slots[slot];
+}
+
+void packet_pool_get_stats(packet_pool_stats_t *stats) {
+    portENTER_CRITICAL(&s_packet_pool_lock);
+    *stats = s_packet_pool_stats;
+    portEXIT_CRITICAL(&s_packet_pool_lock);
+}
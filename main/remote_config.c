@@ -0,0 +1,304 @@
+#include "remote_config.h"
+#include <string.h>
+#include <inttypes.h>
+#include "esp_log.h"
+#include "nvs.h"
+#include "freertos/FreeRTOS.h"
+#include "freertos/semphr.h"
+#include "metrics.h"
+
+static const char *TAG = "REMOTE_CONFIG";
+
+// Where the last applied blob survives a reboot
+#define REMOTE_CONFIG_NVS_NAMESPACE "remote_config"
+#define REMOTE_CONFIG_NVS_VERSION "version"
+#define REMOTE_CONFIG_NVS_BLOB "blob"
+
+// The SX1278 synthesizer range
+#define REMOTE_CONFIG_FREQUENCY_MIN 137000000
+#define REMOTE_CONFIG_FREQUENCY_MAX 525000000
+
+// The configuration in effect and a counter which changes with it,
+// the receive task and the uplink workers each pick it up at
+// a point where switching is safe for them
+static remote_config_t s_config;
+static uint32_t s_config_generation;
+static portMUX_TYPE s_config_lock = portMUX_INITIALIZER_UNLOCKED;
+
+// Version of the last blob which failed the checks, the backend
+// repeats it with every reply until its configuration changes
+static uint32_t s_config_rejected;
+
+// Serializes updates from several workers, so the
+// versions reach NVS in the order they were applied
+static SemaphoreHandle_t s_config_mutex;
+static StaticSemaphore_t s_config_mutex_buffer;
+
+static uint32_t remote_config_read(const uint8_t *in, size_t length) {
+    uint32_t value = 0;
+    for (size_t i = 0; i < length; i++) {
+        value |= (uint32_t)in[i] << (8 * i);
+    }
+    return value;
+}
+
+// Hosts are "https://" followed by the host name and an optional
+// port, the request paths are appended to it. "http://" only with
+// REMOTE_CONFIG_ALLOW_HTTP, a configuration must not be able to
+// move the uplink and every later configuration off TLS
+static bool remote_config_valid_host(const char *host, size_t length) {
+    size_t scheme = length >= 8 && strncmp(host, "https://", 8) == 0 ? 8 : 0;
+#if CONFIG_REMOTE_CONFIG_ALLOW_HTTP
+    if (scheme == 0 && length >= 7 && strncmp(host, "http://", 7) == 0) {
+        scheme = 7;
+    }
+#endif
+    if (scheme == 0 || length == scheme) {
+        return false;
+    }
+    for (size_t i = scheme; i < length; i++) {
+        if (host[i] <= ' ' || host[i] > '~' || host[i] == '/') {
+            return false;
+        }
+    }
+    return true;
+}
+
+// Parses and checks a whole blob, a single bad value rejects it
+static bool remote_config_parse(const uint8_t *blob, size_t length, remote_config_t *config) {
+    memset(config, 0, sizeof(*config));
+
+    if (length < 1 || blob[0] != REMOTE_CONFIG_FORMAT) {
+        return false;
+    }
+
+    size_t offset = 1;
+    while (offset < length) {
+        if (length - offset < 2 || length - offset - 2 < blob[offset + 1]) {
+            return false;
+        }
+        uint8_t key = blob[offset];
+        size_t size = blob[offset + 1];
+        const uint8_t *value = blob + offset + 2;
+        offset += 2 + size;
+
+        uint32_t number = size <= 4 ? remote_config_read(value, size) : 0;
+        switch (key) {
+            case REMOTE_CONFIG_KEY_FREQUENCY:
+                if (size != 4 || number < REMOTE_CONFIG_FREQUENCY_MIN || number > REMOTE_CONFIG_FREQUENCY_MAX) {
+                    return false;
+                }
+                config->frequency = number;
+                config->fields |= REMOTE_CONFIG_HAS_FREQUENCY;
+                break;
+            case REMOTE_CONFIG_KEY_BANDWIDTH:
+                if (size != 4 || number < 7800 || number > 500000) {
+                    return false;
+                }
+                config->bandwidth = number;
+                config->fields |= REMOTE_CONFIG_HAS_BANDWIDTH;
+                break;
+            case REMOTE_CONFIG_KEY_CODING_RATE:
+                if (size != 1 || number < 5 || number > 8) {
+                    return false;
+                }
+                config->coding_rate = number;
+                config->fields |= REMOTE_CONFIG_HAS_CODING_RATE;
+                break;
+            case REMOTE_CONFIG_KEY_PREAMBLE_LENGTH:
+                if (size != 2 || number < 6) {
+                    return false;
+                }
+                config->preamble_length = number;
+                config->fields |= REMOTE_CONFIG_HAS_PREAMBLE_LENGTH;
+                break;
+            case REMOTE_CONFIG_KEY_SPREADING_FACTORS:
+                if (size < 1 || size > RX_SCHEDULER_MAX_PROFILES) {
+                    return false;
+                }
+                for (size_t i = 0; i < size; i++) {
+                    if (value[i] < 7 || value[i] > 12) {
+                        return false;
+                    }
+                    config->spreading_factors[i] = value[i];
+                }
+                config->spreading_factor_count = size;
+                config->fields |= REMOTE_CONFIG_HAS_SPREADING_FACTORS;
+                break;
+            case REMOTE_CONFIG_KEY_UPLINK_HOST:
+                if (size >= REMOTE_CONFIG_HOST_MAX || !remote_config_valid_host((const char *)value, size)) {
+                    return false;
+                }
+                memcpy(config->uplink_host, value, size);
+                config->uplink_host[size] = '\0';
+                config->fields |= REMOTE_CONFIG_HAS_UPLINK_HOST;
+                break;
+            case REMOTE_CONFIG_KEY_UPLINK_TIMEOUT_MS:
+                if (size != 4 || number < 1000 || number > 120000) {
+                    return false;
+                }
+                config->uplink_timeout_ms = number;
+                config->fields |= REMOTE_CONFIG_HAS_UPLINK_TIMEOUT;
+                break;
+            case REMOTE_CONFIG_KEY_BATCH_MAX_WAIT_MS:
+                if (size != 4 || number < 10 || number > 600000) {
+                    return false;
+                }
+                config->batch_max_wait_ms = number;
+                config->fields |= REMOTE_CONFIG_HAS_BATCH_MAX_WAIT;
+                break;
+            case REMOTE_CONFIG_KEY_BATCH_MAX_PACKETS:
+                // The batch buffers are sized for the firmware setting
+                if (size != 1 || number < 1 || number > CONFIG_UPLINK_BATCH_MAX_PACKETS) {
+                    return false;
+                }
+                config->batch_max_packets = number;
+                config->fields |= REMOTE_CONFIG_HAS_BATCH_MAX_PACKETS;
+                break;
+            default:
+                // Meant for a newer firmware
+                break;
+        }
+    }
+
+    return true;
+}
+
+static void remote_config_save(uint32_t version, const uint8_t *blob, size_t length) {
+    nvs_handle_t handle;
+    esp_err_t err = nvs_open(REMOTE_CONFIG_NVS_NAMESPACE, NVS_READWRITE, &handle);
+    if (err == ESP_OK) {
+        // The blob goes first, a version without its blob
+        // would keep the backend from sending it again
+        err = nvs_set_blob(handle, REMOTE_CONFIG_NVS_BLOB, blob, length);
+        if (err == ESP_OK) {
+            err = nvs_set_u32(handle, REMOTE_CONFIG_NVS_VERSION, version);
+        }
+        if (err == ESP_OK) {
+            err = nvs_commit(handle);
+        }
+        nvs_close(handle);
+    }
+
+    if (err != ESP_OK) {
+        ESP_LOGW(TAG, "Configuration %" PRIu32 " not saved: %s", version, esp_err_to_name(err));
+    }
+}
+
+// Loads the configuration the backend sent before the last reboot.
+// Runs after nvs_flash_init(), without one the defaults stay
+esp_err_t remote_config_init(void) {
+    s_config_mutex = xSemaphoreCreateMutexStatic(&s_config_mutex_buffer);
+    memset(&s_config, 0, sizeof(s_config));
+    s_config_generation = 0;
+    s_config_rejected = 0;
+
+    nvs_handle_t handle;
+    if (nvs_open(REMOTE_CONFIG_NVS_NAMESPACE, NVS_READONLY, &handle) != ESP_OK) {
+        return ESP_OK;
+    }
+
+    uint8_t blob[REMOTE_CONFIG_MAX_SIZE];
+    size_t length = sizeof(blob);
+    uint32_t version;
+    esp_err_t err = nvs_get_u32(handle, REMOTE_CONFIG_NVS_VERSION, &version);
+    if (err == ESP_OK) {
+        err = nvs_get_blob(handle, REMOTE_CONFIG_NVS_BLOB, blob, &length);
+    }
+    nvs_close(handle);
+
+    if (err != ESP_OK) {
+        return ESP_OK;
+    }
+
+    // A blob this firmware no longer accepts is asked for again,
+    // the backend sends it along while the versions differ
+    remote_config_t config;
+    if (!remote_config_parse(blob, length, &config)) {
+        ESP_LOGW(TAG, "Saved configuration %" PRIu32 " not valid, using the defaults", version);
+        return ESP_OK;
+    }
+
+    config.version = version;
+    s_config = config;
+    s_config_generation = 1;
+    metrics_gauge(METRIC_GAUGE_CONFIG_VERSION, version);
+    ESP_LOGI(TAG, "Loaded configuration %" PRIu32, version);
+
+    return ESP_OK;
+}
+
+// Applies the configuration blob of a backend reply, if it is newer
+// than the one in effect. It is checked as a whole and then swapped
+// in one step, the receive task and the workers switch over at
+// their next safe point. Returns ESP_OK if there was nothing to do
+esp_err_t remote_config_update(uint32_t version, const uint8_t *blob, size_t length) {
+    xSemaphoreTake(s_config_mutex, portMAX_DELAY);
+
+    if (version <= s_config.version || version == s_config_rejected) {
+        xSemaphoreGive(s_config_mutex);
+        return version == s_config_rejected ? ESP_ERR_INVALID_ARG : ESP_OK;
+    }
+
+    remote_config_t config;
+    if (length > REMOTE_CONFIG_MAX_SIZE || !remote_config_parse(blob, length, &config)) {
+        s_config_rejected = version;
+        xSemaphoreGive(s_config_mutex);
+
+        metrics_count(METRIC_CONFIG_REJECTED);
+        ESP_LOGW(TAG, "Rejected configuration %" PRIu32 " (%u bytes)", version, (unsigned)length);
+        return ESP_ERR_INVALID_ARG;
+    }
+    config.version = version;
+
+    portENTER_CRITICAL(&s_config_lock);
+    s_config = config;
+    s_config_generation++;
+    portEXIT_CRITICAL(&s_config_lock);
+
+    remote_config_save(version, blob, length);
+    xSemaphoreGive(s_config_mutex);
+
+    metrics_count(METRIC_CONFIG_APPLIED);
+    metrics_gauge(METRIC_GAUGE_CONFIG_VERSION, version);
+    ESP_LOGI(TAG, "Applying configuration %" PRIu32, version);
+
+    return ESP_OK;
+}
+
+// Copies the configuration if it changed since the generation
+// the caller last saw. Cheap enough to call on every loop
+bool remote_config_changed(uint32_t *generation, remote_config_t *config) {
+    bool changed = false;
+
+    portENTER_CRITICAL(&s_config_lock);
+    if (*generation != s_config_generation) {
+        *generation = s_config_generation;
+        *config = s_config;
+        changed = true;
+    }
+    portEXIT_CRITICAL(&s_config_lock);
+
+    return changed;
+}
+
+// Puts the radio settings of the configuration
+// over the firmware defaults the caller passes in
+void remote_config_radio(const remote_config_t *config, lora_modem_profile_t *profile, uint8_t *spreading_factors, int *count) {
+    if (config->fields & REMOTE_CONFIG_HAS_FREQUENCY) {
+        profile->frequency = config->frequency;
+    }
+    if (config->fields & REMOTE_CONFIG_HAS_BANDWIDTH) {
+        profile->bandwidth = config->bandwidth;
+    }
+    if (config->fields & REMOTE_CONFIG_HAS_CODING_RATE) {
+        profile->coding_rate = config->coding_rate;
+    }
+    if (config->fields & REMOTE_CONFIG_HAS_PREAMBLE_LENGTH) {
+        profile->preamble_length = config->preamble_length;
+    }
+    if (config->fields & REMOTE_CONFIG_HAS_SPREADING_FACTORS) {
+        memcpy(spreading_factors, config->spreading_factors, config->spreading_factor_count);
+        *count = config->spreading_factor_count;
+    }
+}
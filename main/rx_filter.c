@@ -0,0 +1,261 @@
+#include "rx_filter.h"
+#include <stdbool.h>
+#include <stdlib.h>
+#include <string.h>
+#include "esp_log.h"
+#include "freertos/FreeRTOS.h"
+#include "metrics.h"
+#if CONFIG_RX_FILTER_HMAC
+#include "mbedtls/md.h"
+#endif
+
+static const char *TAG = "RX_FILTER";
+
+// Slots of a node id set, twice the most node ids
+// so a lookup mostly ends at the first probe
+#define RX_FILTER_TABLE_BITS 8
+#define RX_FILTER_TABLE_SIZE (1 << RX_FILTER_TABLE_BITS)
+_Static_assert(RX_FILTER_TABLE_SIZE >= 2 * RX_FILTER_MAX_NODES, "node id set too small");
+
+// Marks an empty slot, the broadcast id can not be allowed
+#define RX_FILTER_EMPTY UINT32_MAX
+
+// Open addressed set of node ids
+typedef struct
+{
+    uint32_t ids[RX_FILTER_TABLE_SIZE];
+    int count;
+} rx_filter_set_t;
+
+// Node ids whose packets are accepted, empty when every
+// node is, and node ids whose packets take the priority lane
+static rx_filter_set_t s_filter_allowed;
+static rx_filter_set_t s_filter_priority;
+
+static rx_filter_stats_t s_filter_stats;
+static portMUX_TYPE s_filter_lock = portMUX_INITIALIZER_UNLOCKED;
+
+#if CONFIG_RX_FILTER_HMAC
+// Longest key, the SHA-256 block size
+#define RX_FILTER_KEY_MAX_SIZE 64
+
+// HMAC-SHA256 context keyed once at startup, every frame only
+// resets it. SHA-256 runs on the SHA accelerator when
+// MBEDTLS_HARDWARE_SHA is enabled
+static mbedtls_md_context_t s_filter_hmac;
+#endif
+
+// Counters of the reject reasons
+static const metric_counter_t s_filter_metrics[RX_FILTER_RESULT_COUNT] = {
+    [RX_FILTER_TOO_SHORT] = METRIC_RX_REJECT_SHORT,
+    [RX_FILTER_UNKNOWN_NODE] = METRIC_RX_REJECT_NODE,
+    [RX_FILTER_BAD_TAG] = METRIC_RX_REJECT_TAG,
+};
+
+static inline uint32_t rx_filter_slot(uint32_t node_id) {
+    return (node_id * 2654435761u) >> (32 - RX_FILTER_TABLE_BITS);
+}
+
+static bool rx_filter_contains(const rx_filter_set_t *set, uint32_t node_id) {
+    // Never full, so an empty slot ends every probe sequence
+    for (uint32_t i = rx_filter_slot(node_id);; i = (i + 1) % RX_FILTER_TABLE_SIZE) {
+        if (set->ids[i] == node_id) {
+            return true;
+        }
+        if (set->ids[i] == RX_FILTER_EMPTY) {
+            return false;
+        }
+    }
+}
+
+static esp_err_t rx_filter_insert(rx_filter_set_t *set, uint32_t node_id) {
+    if (node_id == RX_FILTER_EMPTY) {
+        return ESP_ERR_INVALID_ARG;
+    }
+    if (rx_filter_contains(set, node_id)) {
+        return ESP_OK;
+    }
+    if (set->count == RX_FILTER_MAX_NODES) {
+        return ESP_ERR_INVALID_ARG;
+    }
+
+    uint32_t i = rx_filter_slot(node_id);
+    while (set->ids[i] != RX_FILTER_EMPTY) {
+        i = (i + 1) % RX_FILTER_TABLE_SIZE;
+    }
+    set->ids[i] = node_id;
+    set->count++;
+
+    return ESP_OK;
+}
+
+// Fills the set from comma separated node ids,
+// decimal or 0x prefixed hex
+static esp_err_t rx_filter_parse_set(rx_filter_set_t *set, const char *list) {
+    memset(set->ids, 0xff, sizeof(set->ids));
+    set->count = 0;
+
+    while (*list != '\0') {
+        char *end;
+        unsigned long long node_id = strtoull(list, &end, 0);
+        if (end == list || node_id > UINT32_MAX || (*end != ',' && *end != '\0') || rx_filter_insert(set, node_id) != ESP_OK) {
+            return ESP_ERR_INVALID_ARG;
+        }
+        list = *end == ',' ? end + 1 : end;
+    }
+
+    return ESP_OK;
+}
+
+#if CONFIG_RX_FILTER_HMAC
+static int rx_filter_hex_digit(char c) {
+    if (c >= '0' && c <= '9') {
+        return c - '0';
+    }
+    if (c >= 'a' && c <= 'f') {
+        return c - 'a' + 10;
+    }
+    if (c >= 'A' && c <= 'F') {
+        return c - 'A' + 10;
+    }
+    return -1;
+}
+
+static esp_err_t rx_filter_init_hmac(void) {
+    const char *hex = CONFIG_RX_FILTER_HMAC_KEY;
+    uint8_t key[RX_FILTER_KEY_MAX_SIZE];
+    size_t length = strlen(hex);
+
+    if (length < 32 || length > 2 * sizeof(key) || length % 2 != 0) {
+        ESP_LOGE(TAG, "The HMAC key must be 16 to 64 bytes in hex");
+        return ESP_ERR_INVALID_ARG;
+    }
+    for (size_t i = 0; i < length / 2; i++) {
+        int high = rx_filter_hex_digit(hex[2 * i]);
+        int low = rx_filter_hex_digit(hex[2 * i + 1]);
+        if (high < 0 || low < 0) {
+            ESP_LOGE(TAG, "The HMAC key must be 16 to 64 bytes in hex");
+            return ESP_ERR_INVALID_ARG;
+        }
+        key[i] = (high << 4) | low;
+    }
+
+    mbedtls_md_init(&s_filter_hmac);
+    int ret = mbedtls_md_setup(&s_filter_hmac, mbedtls_md_info_from_type(MBEDTLS_MD_SHA256), 1);
+    if (ret == 0) {
+        ret = mbedtls_md_hmac_starts(&s_filter_hmac, key, length / 2);
+    }
+    memset(key, 0, sizeof(key));
+
+    if (ret != 0) {
+        ESP_LOGE(TAG, "HMAC setup failed: -0x%04x", -ret);
+        mbedtls_md_free(&s_filter_hmac);
+        return ESP_FAIL;
+    }
+
+    return ESP_OK;
+}
+
+// Compares the truncated HMAC at the end of the frame
+// without leaking how many bytes matched
+static bool rx_filter_verify_tag(const uint8_t *frame, size_t length) {
+    uint8_t mac[32];
+
+    if (mbedtls_md_hmac_reset(&s_filter_hmac) != 0 ||
+        mbedtls_md_hmac_update(&s_filter_hmac, frame, length) != 0 ||
+        mbedtls_md_hmac_finish(&s_filter_hmac, mac) != 0) {
+        return false;
+    }
+
+    uint8_t diff = 0;
+    for (int i = 0; i < CONFIG_RX_FILTER_HMAC_TAG_SIZE; i++) {
+        diff |= mac[i] ^ frame[length + i];
+    }
+
+    return diff == 0;
+}
+#endif
+
+esp_err_t rx_filter_init(void) {
+    memset(&s_filter_stats, 0, sizeof(s_filter_stats));
+
+    if (rx_filter_parse_set(&s_filter_allowed, CONFIG_RX_FILTER_ALLOWLIST) != ESP_OK) {
+        ESP_LOGE(TAG, "Invalid node allowlist \"%s\"", CONFIG_RX_FILTER_ALLOWLIST);
+        return ESP_ERR_INVALID_ARG;
+    }
+    if (rx_filter_parse_set(&s_filter_priority, CONFIG_INGEST_PRIORITY_NODES) != ESP_OK) {
+        ESP_LOGE(TAG, "Invalid priority node list \"%s\"", CONFIG_INGEST_PRIORITY_NODES);
+        return ESP_ERR_INVALID_ARG;
+    }
+
+    if (s_filter_allowed.count > 0) {
+        ESP_LOGI(TAG, "Accepting %d nodes", s_filter_allowed.count);
+    }
+
+#if CONFIG_RX_FILTER_HMAC
+    return rx_filter_init_hmac();
+#else
+    return ESP_OK;
+#endif
+}
+
+// Parses the header of a received frame and decides whether
+// it is passed on. Runs in the receive task for every frame,
+// so the cheap checks come first. The tag is cut off an
+// accepted frame, the backend gets the payload as sent
+rx_filter_result_t rx_filter_check(lora_packet_t *packet, lora_header_t *header) {
+    rx_filter_result_t result = RX_FILTER_ACCEPT;
+    size_t size = packet->payload_size;
+
+#if CONFIG_RX_FILTER_HMAC
+    if (size < RX_FILTER_HEADER_SIZE + CONFIG_RX_FILTER_HMAC_TAG_SIZE) {
+#else
+    if (size < RX_FILTER_HEADER_SIZE) {
+#endif
+        result = RX_FILTER_TOO_SHORT;
+    } else {
+        const uint8_t *p = packet->payload;
+        header->node_id = p[0] | (p[1] << 8) | (p[2] << 16) | ((uint32_t)p[3] << 24);
+        header->message_id = p[4] | (p[5] << 8) | (p[6] << 16) | ((uint32_t)p[7] << 24);
+
+        if (s_filter_allowed.count > 0 && !rx_filter_contains(&s_filter_allowed, header->node_id)) {
+            result = RX_FILTER_UNKNOWN_NODE;
+        }
+#if CONFIG_RX_FILTER_HMAC
+        else if (!rx_filter_verify_tag(p, size - CONFIG_RX_FILTER_HMAC_TAG_SIZE)) {
+            result = RX_FILTER_BAD_TAG;
+        } else {
+            packet->payload_size = size - CONFIG_RX_FILTER_HMAC_TAG_SIZE;
+        }
+#endif
+    }
+
+    portENTER_CRITICAL(&s_filter_lock);
+    s_filter_stats.frames[result]++;
+    portEXIT_CRITICAL(&s_filter_lock);
+    if (result != RX_FILTER_ACCEPT) {
+        metrics_count(s_filter_metrics[result]);
+    }
+
+    return result;
+}
+
+// Urgent packets come from a priority node or,
+// with INGEST_PRIORITY_FLAG, carry the top bit of the message id
+ingest_lane_t rx_filter_lane(const lora_header_t *header) {
+#if CONFIG_INGEST_PRIORITY_FLAG
+    if (header->message_id & RX_FILTER_PRIORITY_FLAG) {
+        return INGEST_LANE_PRIORITY;
+    }
+#endif
+    if (s_filter_priority.count > 0 && rx_filter_contains(&s_filter_priority, header->node_id)) {
+        return INGEST_LANE_PRIORITY;
+    }
+    return INGEST_LANE_BULK;
+}
+
+void rx_filter_get_stats(rx_filter_stats_t *stats) {
+    portENTER_CRITICAL(&s_filter_lock);
+    *stats = s_filter_stats;
+    portEXIT_CRITICAL(&s_filter_lock);
+}
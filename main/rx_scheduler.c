@@ -0,0 +1,295 @@
+#include "rx_scheduler.h"
+#include <stdlib.h>
+#include <string.h>
+#include <inttypes.h>
+#include "esp_log.h"
+#include "esp_timer.h"
+#include "lora.h"
+
+static const char *TAG = "RX_SCHED";
+
+// Detections in a row on one profile while packets keep coming,
+// so a busy spreading factor can not starve the others
+#define RX_SCHEDULER_MAX_STAYS 4
+
+typedef enum {
+    // Channel activity detection running on the current profile
+    RX_SCHEDULER_CAD,
+    // Receiving on the current profile after a detection
+    RX_SCHEDULER_LISTEN,
+} rx_scheduler_state_t;
+
+typedef struct
+{
+    lora_modem_profile_t modem;
+    // Longest a detection may take before it counts as idle,
+    // in case its CadDone is lost to an ack frame
+    int64_t cad_timeout_us;
+    // Time from a detected preamble to the end of its header
+    int64_t listen_us;
+} rx_scheduler_profile_t;
+
+// Only the radio receive task runs the scheduler,
+// the lock keeps the counters consistent for readers
+static rx_scheduler_profile_t s_rx_profiles[RX_SCHEDULER_MAX_PROFILES];
+static int s_rx_profile_count;
+static int s_rx_current;
+static rx_scheduler_state_t s_rx_state;
+static int64_t s_rx_deadline_us;
+static int64_t s_rx_listen_start_us;
+static bool s_rx_received;
+static int s_rx_stays;
+// Set while the modem was moved to another profile for a downlink
+// frame, the next poll goes back to the current profile
+static bool s_rx_resume;
+static rx_scheduler_stats_t s_rx_stats;
+static portMUX_TYPE s_rx_lock = portMUX_INITIALIZER_UNLOCKED;
+
+// Profiles of the firmware configuration
+static lora_modem_profile_t s_rx_default_modem;
+static uint8_t s_rx_default_sfs[RX_SCHEDULER_MAX_PROFILES];
+static int s_rx_default_count;
+
+static TickType_t rx_scheduler_wait(int64_t wait_us) {
+    // At least a tick, so the task does not spin until then
+    TickType_t wait = pdMS_TO_TICKS((wait_us + 999) / 1000);
+    return wait > 0 ? wait : 1;
+}
+
+static TickType_t rx_scheduler_start_cad(int64_t now_us) {
+    rx_scheduler_profile_t *profile = &s_rx_profiles[s_rx_current];
+
+    s_rx_state = RX_SCHEDULER_CAD;
+    s_rx_deadline_us = now_us + profile->cad_timeout_us;
+    lora_cad_start();
+
+    return rx_scheduler_wait(profile->cad_timeout_us);
+}
+
+// Replaces the profiles the radio receives on, between packets.
+// Every profile is the base modem setting on one of the spreading
+// factors. The counters start over with the new profiles
+esp_err_t rx_scheduler_configure(const lora_modem_profile_t *base, const uint8_t *spreading_factors, int count) {
+    if (count < 1 || count > RX_SCHEDULER_MAX_PROFILES) {
+        return ESP_ERR_INVALID_ARG;
+    }
+    for (int i = 0; i < count; i++) {
+        if (spreading_factors[i] < 7 || spreading_factors[i] > 12) {
+            return ESP_ERR_INVALID_ARG;
+        }
+    }
+
+    // A detection still running would keep CadDone on DIO0
+    if (rx_scheduler_active() && s_rx_state == RX_SCHEDULER_CAD) {
+        lora_cad_stop();
+    }
+
+    rx_scheduler_stats_t stats = {.profiles = count};
+    for (int i = 0; i < count; i++) {
+        rx_scheduler_profile_t *profile = &s_rx_profiles[i];
+        int sf = spreading_factors[i];
+        int64_t symbol_us = ((int64_t)1000000 << sf) / base->bandwidth;
+        profile->modem = *base;
+        profile->modem.spreading_factor = sf;
+        profile->cad_timeout_us = 4 * symbol_us + 1000;
+        profile->listen_us = lora_time_on_air_us(&profile->modem, 0);
+        stats.profile[i].spreading_factor = sf;
+    }
+    s_rx_profile_count = count;
+
+    portENTER_CRITICAL(&s_rx_lock);
+    s_rx_stats = stats;
+    portEXIT_CRITICAL(&s_rx_lock);
+
+    // A single profile is received on continuously
+    // like before, without detections in between
+    s_rx_current = 0;
+    s_rx_stays = 0;
+    s_rx_resume = false;
+    lora_apply_profile(&s_rx_profiles[0].modem);
+
+    if (s_rx_profile_count > 1) {
+        ESP_LOGI(TAG, "Cycling through %d spreading factors", s_rx_profile_count);
+        rx_scheduler_start_cad(esp_timer_get_time());
+    }
+
+    return ESP_OK;
+}
+
+esp_err_t rx_scheduler_init(void) {
+    lora_get_profile(&s_rx_default_modem);
+    s_rx_default_count = 0;
+
+    // Comma separated spreading factors, every other
+    // setting stays as lora_initialize_radio() left it
+    const char *list = CONFIG_LORA_RX_SPREADING_FACTORS;
+    while (*list != '\0') {
+        char *end;
+        long sf = strtol(list, &end, 10);
+        if (end == list || sf < 7 || sf > 12 || s_rx_default_count == RX_SCHEDULER_MAX_PROFILES ||
+            (*end != ',' && *end != '\0')) {
+            ESP_LOGE(TAG, "Invalid spreading factor list \"%s\"", CONFIG_LORA_RX_SPREADING_FACTORS);
+            return ESP_ERR_INVALID_ARG;
+        }
+
+        s_rx_default_sfs[s_rx_default_count++] = sf;
+        list = *end == ',' ? end + 1 : end;
+    }
+
+    if (s_rx_default_count == 0) {
+        ESP_LOGE(TAG, "No spreading factor to receive on");
+        return ESP_ERR_INVALID_ARG;
+    }
+
+    return rx_scheduler_configure(&s_rx_default_modem, s_rx_default_sfs, s_rx_default_count);
+}
+
+// The modem setting and spreading factors of the firmware,
+// what a remote configuration starts from
+void rx_scheduler_get_defaults(lora_modem_profile_t *base, uint8_t *spreading_factors, int *count) {
+    *base = s_rx_default_modem;
+    memcpy(spreading_factors, s_rx_default_sfs, s_rx_default_count);
+    *count = s_rx_default_count;
+}
+
+bool rx_scheduler_active(void) {
+    return s_rx_profile_count > 1;
+}
+
+// Called for every packet received, ends the listen window so the
+// same profile is checked again right away for the next one
+void rx_scheduler_packet(void) {
+    if (!rx_scheduler_active()) {
+        return;
+    }
+
+    portENTER_CRITICAL(&s_rx_lock);
+    s_rx_stats.profile[s_rx_current].packets++;
+    portEXIT_CRITICAL(&s_rx_lock);
+
+    s_rx_received = true;
+    s_rx_deadline_us = 0;
+}
+
+// Moves between detecting and receiving. Returns how long until the
+// scheduler needs to run again, portMAX_DELAY with a single profile
+TickType_t rx_scheduler_poll(int64_t now_us) {
+    if (!rx_scheduler_active()) {
+        return portMAX_DELAY;
+    }
+
+    rx_scheduler_profile_stats_t *stats = &s_rx_stats.profile[s_rx_current];
+
+    // A downlink frame went out on another profile meanwhile,
+    // detects on the current one again
+    if (s_rx_resume) {
+        s_rx_resume = false;
+        if (s_rx_state == RX_SCHEDULER_LISTEN) {
+            portENTER_CRITICAL(&s_rx_lock);
+            stats->listen_ms += (now_us - s_rx_listen_start_us) / 1000;
+            portEXIT_CRITICAL(&s_rx_lock);
+        }
+        lora_apply_profile(&s_rx_profiles[s_rx_current].modem);
+        return rx_scheduler_start_cad(now_us);
+    }
+
+    if (s_rx_state == RX_SCHEDULER_CAD) {
+        int activity = lora_cad_poll();
+        if (activity < 0 && now_us < s_rx_deadline_us) {
+            return rx_scheduler_wait(s_rx_deadline_us - now_us);
+        }
+
+        portENTER_CRITICAL(&s_rx_lock);
+        stats->cad_runs++;
+        if (activity > 0) {
+            stats->cad_hits++;
+        }
+        portEXIT_CRITICAL(&s_rx_lock);
+
+        // A preamble is on the air, receives until
+        // its header had time to arrive
+        if (activity > 0) {
+            s_rx_state = RX_SCHEDULER_LISTEN;
+            s_rx_received = false;
+            s_rx_listen_start_us = now_us;
+            s_rx_deadline_us = now_us + s_rx_profiles[s_rx_current].listen_us;
+            lora_receive();
+            return rx_scheduler_wait(s_rx_profiles[s_rx_current].listen_us);
+        }
+    } else {
+        // Stays while the modem is locked on a packet,
+        // its RxDone wakes the task
+        if (now_us < s_rx_deadline_us) {
+            return rx_scheduler_wait(s_rx_deadline_us - now_us);
+        }
+        if (lora_rx_in_progress()) {
+            return 1;
+        }
+
+        portENTER_CRITICAL(&s_rx_lock);
+        stats->listen_ms += (now_us - s_rx_listen_start_us) / 1000;
+        portEXIT_CRITICAL(&s_rx_lock);
+
+        // Nodes on a busy spreading factor often send back to back
+        if (s_rx_received && s_rx_stays < RX_SCHEDULER_MAX_STAYS) {
+            s_rx_stays++;
+            return rx_scheduler_start_cad(now_us);
+        }
+    }
+
+    s_rx_stays = 0;
+    s_rx_current = (s_rx_current + 1) % s_rx_profile_count;
+    portENTER_CRITICAL(&s_rx_lock);
+    s_rx_stats.hops++;
+    portEXIT_CRITICAL(&s_rx_lock);
+
+    lora_apply_profile(&s_rx_profiles[s_rx_current].modem);
+    return rx_scheduler_start_cad(now_us);
+}
+
+// The profile the radio receives on, packets read
+// before the next poll came in on it
+int rx_scheduler_current(void) {
+    return s_rx_current;
+}
+
+// Puts the modem on the profile a downlink frame is sent on,
+// the one the packets it answers came in on. The scheduler
+// returns to its own profile on the first poll after the frame
+void rx_scheduler_tx_profile(int index) {
+    if (!rx_scheduler_active()) {
+        return;
+    }
+    if (s_rx_state == RX_SCHEDULER_CAD) {
+        lora_cad_stop();
+    }
+
+    // Acks of packets from before a reconfiguration
+    // go out on the current profile
+    if (index < 0 || index >= s_rx_profile_count) {
+        index = s_rx_current;
+    }
+    lora_apply_profile(&s_rx_profiles[index].modem);
+    s_rx_resume = true;
+}
+
+void rx_scheduler_get_stats(rx_scheduler_stats_t *stats) {
+    portENTER_CRITICAL(&s_rx_lock);
+    *stats = s_rx_stats;
+    portEXIT_CRITICAL(&s_rx_lock);
+}
+
+// Logs the hit rate of every profile. Profiles which never
+// detect anything only cost time the others could use
+void rx_scheduler_report(void) {
+    rx_scheduler_stats_t stats;
+    rx_scheduler_get_stats(&stats);
+
+    for (int i = 0; i < stats.profiles; i++) {
+        rx_scheduler_profile_stats_t *profile = &stats.profile[i];
+        ESP_LOGI(TAG, "SF%d: %" PRIu32 " of %" PRIu32 " detections hit (%.1f%%), %" PRIu32 " packets, %" PRIu32 " ms listening",
+                 profile->spreading_factor, profile->cad_hits, profile->cad_runs,
+                 profile->cad_runs > 0 ? profile->cad_hits * 100.0f / profile->cad_runs : 0.0f,
+                 profile->packets, profile->listen_ms);
+    }
+}
@@ -0,0 +1,475 @@
+#include "spool.h"
+#include <string.h>
+#include <sys/param.h>
+#include <time.h>
+#include "esp_log.h"
+#include "esp_partition.h"
+#include "esp_rom_crc.h"
+#include "esp_timer.h"
+#include "freertos/FreeRTOS.h"
+#include "freertos/semphr.h"
+
+// Log tag
+static const char *TAG = "SPOOL";
+
+// Marks the start of every record
+#define SPOOL_MAGIC 0x5350
+
+// Records are written once and only their state is changed
+// afterwards, flash bits can go from 1 to 0 without an erase
+#define SPOOL_STATE_LIVE 0xff
+#define SPOOL_STATE_CONSUMED 0x00
+
+// Records never cross a sector, so a sector can be
+// erased without touching its neighbours
+#define SPOOL_SECTOR_SIZE 4096
+
+// Every record starts on a 4 byte boundary
+#define SPOOL_ALIGN(size) (((size) + 3) & ~3)
+
+// Record header, followed by the frame
+typedef struct __attribute__((packed))
+{
+    uint16_t magic;
+    uint16_t length;
+    uint32_t sequence;
+    // Seconds from time(), wall clock once it is synchronized
+    uint32_t timestamp;
+    // CRC32 of the fields above and the frame
+    uint32_t crc;
+    uint8_t state;
+    // Uplink batch framing version of the frame,
+    // 0xff in records written before it was stored
+    uint8_t framing;
+    uint8_t reserved[2];
+} spool_record_t;
+
+#define SPOOL_RECORD_MAX_SIZE SPOOL_ALIGN(sizeof(spool_record_t) + UPLINK_BATCH_FRAME_MAX_SIZE)
+
+// Result of reading a record header from flash
+typedef enum
+{
+    SPOOL_SLOT_ERASED,
+    SPOOL_SLOT_VALID,
+    SPOOL_SLOT_CORRUPT,
+} spool_slot_t;
+
+static const esp_partition_t *s_spool_partition;
+static uint32_t s_spool_sectors;
+
+// Offsets into the partition. Records between the read
+// and the write offset are not uploaded yet
+static uint32_t s_spool_read;
+static uint32_t s_spool_write;
+static uint32_t s_spool_sequence;
+
+static spool_stats_t s_spool_stats;
+static int64_t s_spool_last_drain_us;
+
+// Record being written or read
+static uint8_t s_spool_buffer[SPOOL_RECORD_MAX_SIZE];
+
+static SemaphoreHandle_t s_spool_mutex;
+static StaticSemaphore_t s_spool_mutex_buffer;
+
+static uint32_t spool_sector_start(uint32_t offset) {
+    return offset - offset % SPOOL_SECTOR_SIZE;
+}
+
+static uint32_t spool_next_sector(uint32_t offset) {
+    return ((offset / SPOOL_SECTOR_SIZE + 1) % s_spool_sectors) * SPOOL_SECTOR_SIZE;
+}
+
+static uint32_t spool_record_size(const spool_record_t *record) {
+    return SPOOL_ALIGN(sizeof(spool_record_t) + record->length);
+}
+
+// Offset of the record which follows the given one
+static uint32_t spool_record_next(uint32_t offset, const spool_record_t *record) {
+    offset += spool_record_size(record);
+    if (offset % SPOOL_SECTOR_SIZE == 0) {
+        offset = spool_next_sector(offset - 1);
+    }
+    return offset;
+}
+
+static uint32_t spool_record_crc(const spool_record_t *record, const uint8_t *frame) {
+    uint32_t crc = esp_rom_crc32_le(0, (const uint8_t *)record, offsetof(spool_record_t, crc));
+    return esp_rom_crc32_le(crc, frame, record->length);
+}
+
+// Reads the record at the given offset into the record buffer
+// and checks it. The frame follows the header in the buffer
+static spool_slot_t spool_read_record(uint32_t offset, spool_record_t *record) {
+    if (SPOOL_SECTOR_SIZE - offset % SPOOL_SECTOR_SIZE < sizeof(spool_record_t)) {
+        return SPOOL_SLOT_ERASED;
+    }
+
+    if (esp_partition_read(s_spool_partition, offset, record, sizeof(*record)) != ESP_OK) {
+        return SPOOL_SLOT_CORRUPT;
+    }
+
+    if (record->magic == 0xffff && record->length == 0xffff) {
+        return SPOOL_SLOT_ERASED;
+    }
+
+    if (record->magic != SPOOL_MAGIC || record->length > UPLINK_BATCH_FRAME_MAX_SIZE ||
+        offset % SPOOL_SECTOR_SIZE + spool_record_size(record) > SPOOL_SECTOR_SIZE) {
+        return SPOOL_SLOT_CORRUPT;
+    }
+
+    uint8_t *frame = s_spool_buffer + sizeof(spool_record_t);
+    if (esp_partition_read(s_spool_partition, offset + sizeof(spool_record_t), frame, record->length) != ESP_OK ||
+        spool_record_crc(record, frame) != record->crc) {
+        return SPOOL_SLOT_CORRUPT;
+    }
+
+    return SPOOL_SLOT_VALID;
+}
+
+// Moves the offset forward to the next record which is not
+// uploaded yet. Consumed records are stepped over, a corrupt
+// record makes the rest of its sector unreadable and is skipped.
+// Returns false when the write offset is reached
+static bool spool_seek_live(uint32_t *offset, spool_record_t *record) {
+    while (*offset != s_spool_write) {
+        spool_slot_t slot = spool_read_record(*offset, record);
+
+        if (slot == SPOOL_SLOT_VALID) {
+            if (record->state == SPOOL_STATE_LIVE) {
+                return true;
+            }
+            *offset = spool_record_next(*offset, record);
+            continue;
+        }
+
+        if (slot == SPOOL_SLOT_CORRUPT) {
+            s_spool_stats.corrupt++;
+        }
+
+        // Nothing more in this sector
+        if (spool_sector_start(*offset) == spool_sector_start(s_spool_write)) {
+            *offset = s_spool_write;
+        } else {
+            *offset = spool_next_sector(*offset);
+        }
+    }
+
+    return false;
+}
+
+// Counts the records of a sector which are not uploaded yet
+static uint32_t spool_count_live(uint32_t sector, uint32_t *bytes) {
+    spool_record_t record;
+    uint32_t offset = sector;
+    uint32_t count = 0;
+
+    while (offset < sector + SPOOL_SECTOR_SIZE && offset != s_spool_write &&
+           spool_read_record(offset, &record) == SPOOL_SLOT_VALID) {
+        if (record.state == SPOOL_STATE_LIVE) {
+            count++;
+            *bytes += spool_record_size(&record);
+        }
+        offset += spool_record_size(&record);
+    }
+
+    return count;
+}
+
+// Moves the write offset to the start of the given sector and
+// erases it. When the spool is full the oldest sector goes
+static esp_err_t spool_open_sector(uint32_t sector) {
+    if (s_spool_stats.records > 0 && spool_sector_start(s_spool_read) == sector) {
+        uint32_t bytes = 0;
+        uint32_t lost = spool_count_live(sector, &bytes);
+
+        s_spool_stats.dropped += lost;
+        s_spool_stats.records -= lost;
+        s_spool_stats.used_bytes -= bytes;
+        s_spool_read = spool_next_sector(sector);
+        if (lost > 0) {
+            ESP_LOGW(TAG, "Spool full, dropped %" PRIu32 " records", lost);
+        }
+    }
+
+    esp_err_t err = esp_partition_erase_range(s_spool_partition, sector, SPOOL_SECTOR_SIZE);
+    if (err != ESP_OK) {
+        return err;
+    }
+
+    s_spool_write = sector;
+    if (s_spool_stats.records == 0) {
+        s_spool_read = sector;
+    }
+
+    return ESP_OK;
+}
+
+// Finds the read and write offsets left by the previous boot.
+// The sector whose first record has the highest sequence number
+// holds the write offset, the first live record after it the read offset
+static esp_err_t spool_mount(void) {
+    spool_record_t record;
+    int32_t newest = -1;
+    uint32_t newest_sequence = 0;
+
+    for (uint32_t sector = 0; sector < s_spool_sectors; sector++) {
+        if (spool_read_record(sector * SPOOL_SECTOR_SIZE, &record) == SPOOL_SLOT_VALID &&
+            (newest < 0 || record.sequence > newest_sequence)) {
+            newest = sector;
+            newest_sequence = record.sequence;
+        }
+    }
+
+    // Empty or unreadable spool, starts over
+    if (newest < 0) {
+        s_spool_sequence = 0;
+        return spool_open_sector(0);
+    }
+
+    // Walks the newest sector up to its end
+    uint32_t sector_end = (newest + 1) * SPOOL_SECTOR_SIZE;
+    uint32_t offset = newest * SPOOL_SECTOR_SIZE;
+    spool_slot_t slot = SPOOL_SLOT_ERASED;
+    while (offset < sector_end && (slot = spool_read_record(offset, &record)) == SPOOL_SLOT_VALID) {
+        s_spool_sequence = record.sequence + 1;
+        offset += spool_record_size(&record);
+    }
+
+    // Counts the records which are not uploaded yet, oldest sector
+    // first. No write offset yet so whole sectors are walked
+    bool found = false;
+    s_spool_write = UINT32_MAX;
+    for (uint32_t i = 1; i <= s_spool_sectors; i++) {
+        uint32_t sector = ((newest + i) % s_spool_sectors) * SPOOL_SECTOR_SIZE;
+        uint32_t live = spool_count_live(sector, &s_spool_stats.used_bytes);
+
+        if (live > 0 && !found) {
+            s_spool_read = sector;
+            found = true;
+        }
+        s_spool_stats.records += live;
+    }
+
+    s_spool_write = offset;
+    if (!found) {
+        s_spool_read = offset;
+    }
+
+    // A full sector, or a record torn by a reset which can not
+    // be written over, the next record goes into a fresh sector
+    if (offset >= sector_end || slot == SPOOL_SLOT_CORRUPT) {
+        esp_err_t err = spool_open_sector(spool_next_sector(newest * SPOOL_SECTOR_SIZE));
+        if (err != ESP_OK) {
+            return err;
+        }
+    }
+
+    if (s_spool_stats.records > 0) {
+        spool_seek_live(&s_spool_read, &record);
+    }
+
+    return ESP_OK;
+}
+
+esp_err_t spool_init(void) {
+    s_spool_partition = esp_partition_find_first(ESP_PARTITION_TYPE_DATA, ESP_PARTITION_SUBTYPE_ANY, CONFIG_SPOOL_PARTITION_LABEL);
+    if (s_spool_partition == NULL) {
+        ESP_LOGE(TAG, "Partition \"%s\" not found", CONFIG_SPOOL_PARTITION_LABEL);
+        return ESP_ERR_NOT_FOUND;
+    }
+
+    s_spool_sectors = s_spool_partition->size / SPOOL_SECTOR_SIZE;
+    if (s_spool_sectors < 2) {
+        return ESP_ERR_INVALID_SIZE;
+    }
+
+    s_spool_mutex = xSemaphoreCreateMutexStatic(&s_spool_mutex_buffer);
+
+    memset(&s_spool_stats, 0, sizeof(s_spool_stats));
+    s_spool_stats.capacity_bytes = s_spool_sectors * SPOOL_SECTOR_SIZE;
+
+    esp_err_t err = spool_mount();
+    ESP_LOGI(TAG, "Mounted, %" PRIu32 " records waiting", s_spool_stats.records);
+
+    return err;
+}
+
+esp_err_t spool_append(const uint8_t *frame, size_t size) {
+    if (s_spool_partition == NULL) {
+        return ESP_ERR_INVALID_STATE;
+    }
+    if (size > UPLINK_BATCH_FRAME_MAX_SIZE) {
+        return ESP_ERR_INVALID_SIZE;
+    }
+
+    uint32_t record_size = SPOOL_ALIGN(sizeof(spool_record_t) + size);
+    esp_err_t err = ESP_OK;
+
+    xSemaphoreTake(s_spool_mutex, portMAX_DELAY);
+
+    // Records never cross a sector
+    if (s_spool_write % SPOOL_SECTOR_SIZE + record_size > SPOOL_SECTOR_SIZE) {
+        err = spool_open_sector(spool_next_sector(s_spool_write));
+    }
+
+    if (err == ESP_OK) {
+        spool_record_t *record = (spool_record_t *)s_spool_buffer;
+        *record = (spool_record_t){
+            .magic = SPOOL_MAGIC,
+            .length = size,
+            .sequence = s_spool_sequence,
+            .timestamp = (uint32_t)time(NULL),
+            .state = SPOOL_STATE_LIVE,
+            .framing = CONFIG_UPLINK_BATCH_FRAMING_VERSION,
+            .reserved = {0xff, 0xff},
+        };
+        memcpy(s_spool_buffer + sizeof(spool_record_t), frame, size);
+        record->crc = spool_record_crc(record, s_spool_buffer + sizeof(spool_record_t));
+
+        err = esp_partition_write(s_spool_partition, s_spool_write, s_spool_buffer, sizeof(spool_record_t) + size);
+    }
+
+    if (err == ESP_OK) {
+        uint32_t start = s_spool_write;
+
+        s_spool_sequence++;
+        s_spool_stats.appended++;
+        s_spool_stats.records++;
+        s_spool_stats.used_bytes += record_size;
+
+        s_spool_write += record_size;
+        if (s_spool_write % SPOOL_SECTOR_SIZE == 0) {
+            // The sector is full, moves on to the next one
+            err = spool_open_sector(spool_next_sector(start));
+        }
+    }
+
+    xSemaphoreGive(s_spool_mutex);
+
+    return err;
+}
+
+esp_err_t spool_append_batch(const uplink_batch_t *batch) {
+    const uint8_t *frame;
+    size_t size;
+    size_t offset = 0;
+    esp_err_t err = ESP_OK;
+
+    while (err == ESP_OK && uplink_batch_next_frame(batch, &offset, &frame, &size)) {
+        err = spool_append(frame, size);
+    }
+
+    return err;
+}
+
+int spool_read_batch(uplink_batch_t *batch, int max_frames, spool_cursor_t *cursor) {
+    spool_record_t record;
+    int count = 0;
+
+    if (s_spool_partition == NULL) {
+        return 0;
+    }
+
+    xSemaphoreTake(s_spool_mutex, portMAX_DELAY);
+
+    uint32_t offset = s_spool_read;
+    cursor->start = s_spool_read;
+
+    while (count < max_frames && !uplink_batch_full(batch) && spool_seek_live(&offset, &record)) {
+        uint8_t *frame = s_spool_buffer + sizeof(spool_record_t);
+        size_t size = record.length;
+        uint8_t framing = record.framing == 0xff ? 1 : record.framing;
+
+        // Frames spooled by a firmware with another framing version
+        // get their metadata envelope cut down or padded. The older
+        // envelopes are a prefix of the newer ones, missing fields are 0
+        size_t old_envelope = uplink_batch_envelope_size(framing);
+        size_t new_envelope = uplink_batch_envelope_size(CONFIG_UPLINK_BATCH_FRAMING_VERSION);
+        if (old_envelope != new_envelope && size >= old_envelope) {
+            uint8_t envelope[UPLINK_BATCH_ENVELOPE_SIZE] = {0};
+            memcpy(envelope, frame, MIN(old_envelope, new_envelope));
+            size -= old_envelope;
+            memmove(frame + new_envelope, frame + old_envelope, size);
+            memcpy(frame, envelope, new_envelope);
+            size += new_envelope;
+        }
+
+        uplink_batch_add_frame(batch, frame, size);
+        offset = spool_record_next(offset, &record);
+        count++;
+    }
+
+    cursor->end = offset;
+    cursor->records = count;
+
+    xSemaphoreGive(s_spool_mutex);
+
+    return count;
+}
+
+esp_err_t spool_consume(const spool_cursor_t *cursor) {
+    static const uint8_t consumed = SPOOL_STATE_CONSUMED;
+    spool_record_t record;
+
+    xSemaphoreTake(s_spool_mutex, portMAX_DELAY);
+
+    // The records were overwritten while they were uploaded,
+    // they are already counted as dropped
+    if (s_spool_read != cursor->start) {
+        xSemaphoreGive(s_spool_mutex);
+        return ESP_ERR_INVALID_STATE;
+    }
+
+    // Marks every record as uploaded, so they
+    // are not sent again after a reboot
+    uint32_t offset = cursor->start;
+    while (offset != cursor->end && spool_seek_live(&offset, &record)) {
+        esp_partition_write(s_spool_partition, offset + offsetof(spool_record_t, state), &consumed, sizeof(consumed));
+        s_spool_stats.records--;
+        s_spool_stats.used_bytes -= spool_record_size(&record);
+        s_spool_stats.drained++;
+        offset = spool_record_next(offset, &record);
+    }
+
+    s_spool_read = cursor->end;
+    spool_seek_live(&s_spool_read, &record);
+
+    // Smooths the drain rate over the last few batches
+    int64_t now = esp_timer_get_time();
+    if (s_spool_last_drain_us > 0 && now > s_spool_last_drain_us) {
+        float rate = cursor->records * 1e6f / (now - s_spool_last_drain_us);
+        s_spool_stats.drain_rate += (rate - s_spool_stats.drain_rate) / 4;
+    }
+    s_spool_last_drain_us = now;
+
+    xSemaphoreGive(s_spool_mutex);
+
+    return ESP_OK;
+}
+
+bool spool_empty(void) {
+    return s_spool_partition == NULL || s_spool_stats.records == 0;
+}
+
+void spool_get_stats(spool_stats_t *stats) {
+    spool_record_t record;
+
+    if (s_spool_partition == NULL) {
+        memset(stats, 0, sizeof(*stats));
+        return;
+    }
+
+    xSemaphoreTake(s_spool_mutex, portMAX_DELAY);
+
+    *stats = s_spool_stats;
+    stats->oldest_age_sec = 0;
+
+    uint32_t offset = s_spool_read;
+    if (spool_seek_live(&offset, &record)) {
+        uint32_t now = (uint32_t)time(NULL);
+        stats->oldest_age_sec = now > record.timestamp ? now - record.timestamp : 0;
+    }
+
+    xSemaphoreGive(s_spool_mutex);
+}
@@ -0,0 +1,157 @@
+#include <string.h>
+#include <inttypes.h>
+#include "esp_log.h"
+#include "esp_timer.h"
+#include "freertos/FreeRTOS.h"
+#include "freertos/task.h"
+#include "freertos/semphr.h"
+#include "trace.h"
+
+// Log tag
+static const char *TAG = "TRACE";
+
+// Ring of event records. Writers claim a sequence number
+// with a single atomic add and never wait, when the ring
+// is full the oldest records are overwritten
+static trace_record_t s_trace_ring[TRACE_BUFFER_RECORDS];
+static uint32_t s_trace_head;
+
+// Next record the formatter expects and the records
+// it found overwritten before it got to them
+static uint32_t s_trace_tail;
+static uint32_t s_trace_lost;
+
+// Serializes the drain task and on demand dumps
+static SemaphoreHandle_t s_trace_mutex;
+static StaticSemaphore_t s_trace_mutex_buffer;
+
+static const char *const s_trace_event_names[TRACE_EVENT_COUNT] = {
+    [TRACE_HTTP_ERROR] = "http error",
+    [TRACE_HTTP_CONNECTED] = "http connected",
+    [TRACE_HTTP_HEADER_SENT] = "http header sent",
+    [TRACE_HTTP_DISCONNECTED] = "http disconnected",
+    [TRACE_UPLOAD_DONE] = "upload done",
+    [TRACE_UPLOAD_FAILED] = "upload failed",
+    [TRACE_UPLOAD_REJECTED] = "upload rejected",
+    [TRACE_BATCH_DROPPED] = "batch dropped",
+    [TRACE_POOL_EXHAUSTED] = "packet pool exhausted",
+};
+
+void trace_event(trace_event_t event, uint16_t arg0, uint32_t arg1) {
+    uint32_t seq = __atomic_fetch_add(&s_trace_head, 1, __ATOMIC_RELAXED);
+    trace_record_t *record = &s_trace_ring[seq & (TRACE_BUFFER_RECORDS - 1)];
+
+    // Marks the record invalid before the fields change, a reader
+    // copying the older record meanwhile sees seq change under it
+    __atomic_store_n(&record->seq, 0, __ATOMIC_RELAXED);
+    __atomic_thread_fence(__ATOMIC_RELEASE);
+
+    record->time_ms = (uint32_t)(esp_timer_get_time() / 1000);
+    record->event = event;
+    record->arg0 = arg0;
+    record->arg1 = arg1;
+
+    // Sequence numbers are stored off by one,
+    // so a zeroed record never looks complete
+    __atomic_store_n(&record->seq, seq + 1, __ATOMIC_RELEASE);
+}
+
+// Formats one record, the only place which pays for the log output
+static void trace_format(const trace_record_t *record) {
+    const char *name = record->event < TRACE_EVENT_COUNT ? s_trace_event_names[record->event] : "unknown";
+
+    switch (record->event) {
+        case TRACE_HTTP_CONNECTED:
+            ESP_LOGI(TAG, "%" PRIu32 " ms %s after %" PRIu32 " us", record->time_ms, name, record->arg1);
+            break;
+        case TRACE_HTTP_DISCONNECTED:
+            ESP_LOGI(TAG, "%" PRIu32 " ms %s, esp-tls 0x%" PRIx32 ", mbedtls -0x%x", record->time_ms, name, record->arg1, record->arg0);
+            break;
+        case TRACE_UPLOAD_DONE:
+            ESP_LOGI(TAG, "%" PRIu32 " ms %s, status %u, %" PRIu32 " frames", record->time_ms, name, record->arg0, record->arg1);
+            break;
+        case TRACE_UPLOAD_FAILED:
+            ESP_LOGE(TAG, "%" PRIu32 " ms %s, attempt %u, %s", record->time_ms, name, record->arg0, esp_err_to_name(record->arg1));
+            break;
+        case TRACE_UPLOAD_REJECTED:
+            ESP_LOGE(TAG, "%" PRIu32 " ms %s, attempt %u, status %" PRIu32, record->time_ms, name, record->arg0, record->arg1);
+            break;
+        case TRACE_BATCH_DROPPED:
+            ESP_LOGE(TAG, "%" PRIu32 " ms %s, %u frames", record->time_ms, name, record->arg0);
+            break;
+        case TRACE_POOL_EXHAUSTED:
+            ESP_LOGW(TAG, "%" PRIu32 " ms %s", record->time_ms, name);
+            break;
+        default:
+            ESP_LOGI(TAG, "%" PRIu32 " ms %s", record->time_ms, name);
+            break;
+    }
+}
+
+// Formats every record written since the last call
+void trace_dump(void) {
+    xSemaphoreTake(s_trace_mutex, portMAX_DELAY);
+
+    uint32_t head = __atomic_load_n(&s_trace_head, __ATOMIC_ACQUIRE);
+
+    // Skips what was overwritten before we got to it
+    if (head - s_trace_tail > TRACE_BUFFER_RECORDS) {
+        s_trace_lost += head - s_trace_tail - TRACE_BUFFER_RECORDS;
+        s_trace_tail = head - TRACE_BUFFER_RECORDS;
+    }
+
+    while (s_trace_tail != head) {
+        const trace_record_t *slot = &s_trace_ring[s_trace_tail & (TRACE_BUFFER_RECORDS - 1)];
+        trace_record_t record;
+
+        // Copies the record and checks it was neither half written
+        // nor overwritten meanwhile. The writer clears seq first,
+        // so a copy it raced with never sees the same seq twice
+        uint32_t seq = __atomic_load_n(&slot->seq, __ATOMIC_ACQUIRE);
+        record = *slot;
+        __atomic_thread_fence(__ATOMIC_ACQUIRE);
+        if (seq != s_trace_tail + 1 || __atomic_load_n(&slot->seq, __ATOMIC_RELAXED) != seq) {
+            if ((int32_t)(seq - (s_trace_tail + 1)) > 0) {
+                // Already overwritten by a newer record
+                s_trace_lost++;
+                s_trace_tail++;
+                continue;
+            }
+            // Claimed but not written yet, comes next time
+            break;
+        }
+
+        trace_format(&record);
+        s_trace_tail++;
+    }
+
+    if (s_trace_lost > 0) {
+        ESP_LOGW(TAG, "%" PRIu32 " records lost", s_trace_lost);
+        s_trace_lost = 0;
+    }
+
+    xSemaphoreGive(s_trace_mutex);
+}
+
+#if CONFIG_TRACE_DRAIN_INTERVAL_MS > 0
+// Formats the trace at the lowest priority, the tasks
+// which wrote the records never wait for the console
+static void trace_drain_task(void *pvParameters) {
+    while (1) {
+        vTaskDelay(pdMS_TO_TICKS(CONFIG_TRACE_DRAIN_INTERVAL_MS));
+        trace_dump();
+    }
+}
+#endif
+
+esp_err_t trace_init(void) {
+    s_trace_mutex = xSemaphoreCreateMutexStatic(&s_trace_mutex_buffer);
+
+#if CONFIG_TRACE_DRAIN_INTERVAL_MS > 0
+    if (xTaskCreate(&trace_drain_task, "trace_drain_task", 3072, NULL, tskIDLE_PRIORITY + 1, NULL) != pdPASS) {
+        return ESP_ERR_NO_MEM;
+    }
+#endif
+
+    return ESP_OK;
+}
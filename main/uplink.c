@@ -0,0 +1,405 @@
+#include <string.h>
+#include <sys/param.h>
+#include <stdlib.h>
+#include <inttypes.h>
+#include "esp_log.h"
+#include "esp_tls.h"
+#include "esp_timer.h"
+#include "uplink.h"
+#include "metrics.h"
+#include "trace.h"
+
+// The backend authentication token
+#define BACKEND_AUTH_TOKEN "uO0Ofm2uGvOYG3p67kffMlUBP7uYPM"
+
+// Log tag
+static const char *TAG = "UPLINK";
+
+// The backend, on the linux target the local
+// sink of the pipeline benchmark stands in for it
+#if CONFIG_IDF_TARGET_LINUX
+#define UPLINK_STRINGIFY(x) #x
+#define UPLINK_PORT(x) UPLINK_STRINGIFY(x)
+#define UPLINK_HOST_URL "http://127.0.0.1:" UPLINK_PORT(CONFIG_BENCH_SINK_PORT)
+#else
+#define UPLINK_HOST_URL "https://dragonhack.ttcloud.io"
+#endif
+#define UPLINK_DATA_PATH "/api/data"
+#define UPLINK_HEARTBEAT_PATH "/api/heartbeat"
+
+// Request timeout unless the backend configures another one
+#define UPLINK_TIMEOUT_MS 15000
+
+// The google trust chain root certificate
+// for https
+extern const char gtsr1_root_cert_pem_start[] asm("_binary_gtsr1_root_cert_pem_start");
+extern const char gtsr1_root_cert_pem_end[] asm("_binary_gtsr1_root_cert_pem_end");
+
+static esp_err_t _http_event_handler(esp_http_client_event_t *evt) {
+    // The uplink which performs the request,
+    // its response arena collects the response body
+    uplink_client_t *uplink = evt->user_data;
+
+    switch (evt->event_id) {
+        case HTTP_EVENT_ERROR:
+            trace_event(TRACE_HTTP_ERROR, 0, 0);
+            ESP_LOGD(TAG, "HTTP_EVENT_ERROR");
+            break;
+        case HTTP_EVENT_ON_CONNECTED:
+            // Only raised for new connections, requests on a
+            // kept alive connection skip it. A saved session means
+            // the handshake offered it, the backend may still
+            // have answered with a full handshake
+            {
+                int64_t connect_us = esp_timer_get_time() - uplink->request_start_us;
+                if (uplink->session_saved) {
+                    uplink->stats.session_offers++;
+                    uplink->stats.session_offer_us += connect_us;
+                } else {
+                    uplink->stats.full_handshakes++;
+                    uplink->stats.full_handshake_us += connect_us;
+                }
+                trace_event(TRACE_HTTP_CONNECTED, 0, (uint32_t)connect_us);
+            }
+#if CONFIG_UPLINK_TLS_SESSION_RESUMPTION
+            uplink->session_saved = true;
+#endif
+
+            ESP_LOGD(TAG, "HTTP_EVENT_ON_CONNECTED");
+            break;
+        case HTTP_EVENT_HEADER_SENT:
+            // Every attempt starts with an empty response
+            uplink->response_length = 0;
+            uplink->response_truncated = false;
+
+            trace_event(TRACE_HTTP_HEADER_SENT, 0, 0);
+            ESP_LOGD(TAG, "HTTP_EVENT_HEADER_SENT");
+            break;
+        case HTTP_EVENT_ON_HEADER:
+            ESP_LOGD(TAG, "HTTP_EVENT_ON_HEADER, key=%s, value=%s", evt->header_key, evt->header_value);
+            break;
+        case HTTP_EVENT_ON_DATA:
+            // Copies the response into the preallocated arena,
+            // chunked or not. Anything beyond its size is dropped
+            // and the reply is not parsed
+            {
+                size_t room = sizeof(uplink->response) - uplink->response_length;
+                size_t copy_len = MIN((size_t)evt->data_len, room);
+                if (copy_len > 0) {
+                    memcpy(uplink->response + uplink->response_length, evt->data, copy_len);
+                    uplink->response_length += copy_len;
+                }
+                if (copy_len < (size_t)evt->data_len) {
+                    uplink->response_truncated = true;
+                }
+            }
+            break;
+        case HTTP_EVENT_DISCONNECTED:
+            int mbedtls_err = 0;
+            esp_err_t err = esp_tls_get_and_clear_last_error((esp_tls_error_handle_t)evt->data, &mbedtls_err, NULL);
+            if (err != 0) {
+                trace_event(TRACE_HTTP_DISCONNECTED, (uint16_t)-mbedtls_err, err);
+            }
+            break;
+        default:
+            // Not interested
+    }
+   
+    return ESP_OK;
+}
+
+static uint32_t uplink_read_u32(const uint8_t *in) {
+    return in[0] | (in[1] << 8) | (in[2] << 16) | ((uint32_t)in[3] << 24);
+}
+
+// Parses the reply of the backend in place, the config
+// blob points into the response arena and stays valid
+// until the next request is started
+static void uplink_parse_reply(uplink_client_t *uplink) {
+    const uint8_t *in = uplink->response;
+    size_t length = uplink->response_length;
+    uplink_reply_t *reply = &uplink->reply;
+
+    memset(reply, 0, sizeof(*reply));
+
+    if (uplink->response_truncated || length < UPLINK_REPLY_HEADER_SIZE || in[0] != UPLINK_REPLY_VERSION) {
+        return;
+    }
+
+    reply->flags = in[1];
+    reply->ack_sequence = uplink_read_u32(in + 2);
+    reply->config_version = uplink_read_u32(in + 6);
+
+    if (reply->flags & UPLINK_REPLY_FLAG_CONFIG) {
+        if (length < UPLINK_REPLY_HEADER_SIZE + 2) {
+            return;
+        }
+        size_t config_length = in[10] | (in[11] << 8);
+        if (length < UPLINK_REPLY_HEADER_SIZE + 2 + config_length) {
+            return;
+        }
+        reply->config = in + UPLINK_REPLY_HEADER_SIZE + 2;
+        reply->config_length = config_length;
+    }
+
+    reply->valid = true;
+}
+
+// Builds the request urls from the backend host
+static esp_err_t uplink_set_host(uplink_client_t *uplink, const char *host) {
+    int data = snprintf(uplink->data_url, sizeof(uplink->data_url), "%s" UPLINK_DATA_PATH, host);
+    int heartbeat = snprintf(uplink->heartbeat_url, sizeof(uplink->heartbeat_url), "%s" UPLINK_HEARTBEAT_PATH, host);
+    if (data >= (int)sizeof(uplink->data_url) || heartbeat >= (int)sizeof(uplink->heartbeat_url)) {
+        return ESP_ERR_INVALID_SIZE;
+    }
+    return ESP_OK;
+}
+
+esp_err_t uplink_client_init(uplink_client_t *uplink) {
+    memset(uplink, 0, sizeof(*uplink));
+    uplink->backoff_ms = CONFIG_UPLINK_BACKOFF_MIN_MS;
+    uplink_set_host(uplink, UPLINK_HOST_URL);
+
+    // Client config
+    // the url of the target server
+    // the google trust chain root certificate for https
+    // and a request timeout.
+    // The connection is kept open between requests and
+    // TCP keep-alive probes detect a dead one, so a new
+    // TLS handshake is only needed after a disconnect
+    esp_http_client_config_t config = {
+        .url = uplink->data_url,
+        .event_handler = _http_event_handler,
+        .user_data = uplink,
+        .cert_pem = gtsr1_root_cert_pem_start,
+        .is_async = true,
+        .timeout_ms = UPLINK_TIMEOUT_MS,
+#if CONFIG_UPLINK_PERSISTENT_CONNECTION
+        .keep_alive_enable = true,
+        .keep_alive_idle = CONFIG_UPLINK_KEEP_ALIVE_IDLE_SEC,
+        .keep_alive_interval = 5,
+        .keep_alive_count = 3,
+#endif
+#if CONFIG_UPLINK_TLS_SESSION_RESUMPTION
+        // Keeps the TLS session (ticket or id) of the last
+        // connection and offers it on the next handshake
+        .save_client_session = true,
+#endif
+    };
+
+    // Initializes the client (we are sending a request to a server
+    // and as such are considered a client)
+    // with the url or the server
+    uplink->client = esp_http_client_init(&config);
+    if (uplink->client == NULL) {
+        return ESP_FAIL;
+    }
+    uplink->url = uplink->data_url;
+
+    // Sets the request method to POST (as we are sending data)
+    esp_http_client_set_method(uplink->client, HTTP_METHOD_POST);
+
+    // Sets the request Authorization header which provides the auth token
+    esp_http_client_set_header(uplink->client, "Authorization", "Basic " BACKEND_AUTH_TOKEN);
+
+    // Sets the content header to octet-stream as we are sending raw
+    // binary data
+    esp_http_client_set_header(uplink->client, "Content-Type", "application/octet-stream");
+
+#if !CONFIG_UPLINK_PERSISTENT_CONNECTION
+    esp_http_client_set_header(uplink->client, "Connection", "close");
+#endif
+
+    return ESP_OK;
+}
+
+// Switches to the backend host and request timeout of a remote
+// configuration, NULL and 0 restore the firmware defaults. Only
+// while no request is outstanding, the next one uses them.
+// The version tells the backend which configuration is in effect
+esp_err_t uplink_configure(uplink_client_t *uplink, const char *host, uint32_t timeout_ms, uint32_t config_version) {
+    if (uplink->state != UPLINK_STATE_IDLE) {
+        return ESP_ERR_INVALID_STATE;
+    }
+
+    char previous[UPLINK_URL_MAX_SIZE];
+    strcpy(previous, uplink->data_url);
+    // A host too long for the urls falls back to the default
+    if (uplink_set_host(uplink, host != NULL ? host : UPLINK_HOST_URL) != ESP_OK) {
+        uplink_set_host(uplink, UPLINK_HOST_URL);
+    }
+
+    // A new host needs a new connection, which
+    // esp_http_client_set_url opens on the next request
+    if (strcmp(previous, uplink->data_url) != 0) {
+        uplink->url = NULL;
+        uplink->session_saved = false;
+        ESP_LOGI(TAG, "Backend is now %s", uplink->data_url);
+    }
+
+    esp_http_client_set_timeout_ms(uplink->client, timeout_ms > 0 ? timeout_ms : UPLINK_TIMEOUT_MS);
+
+    char version[11];
+    snprintf(version, sizeof(version), "%" PRIu32, config_version);
+    esp_http_client_set_header(uplink->client, "X-Config-Version", version);
+
+    return ESP_OK;
+}
+
+static esp_err_t uplink_start_request(uplink_client_t *uplink, const char *url, const uint8_t *body, size_t length, int frames,
+                                      const char *encoding) {
+    if (uplink->state != UPLINK_STATE_IDLE) {
+        return ESP_ERR_INVALID_STATE;
+    }
+
+    // Both urls point to the same host,
+    // switching keeps the connection open
+    if (uplink->url != url) {
+        esp_http_client_set_url(uplink->client, url);
+        uplink->url = url;
+    }
+
+    // A compressed body is announced like a content encoding,
+    // the header only changes when the encoding does
+    if (uplink->encoding != encoding) {
+        if (encoding != NULL) {
+            esp_http_client_set_header(uplink->client, "Content-Encoding", encoding);
+        } else {
+            esp_http_client_delete_header(uplink->client, "Content-Encoding");
+        }
+        uplink->encoding = encoding;
+    }
+
+    // Sets the request body (to the encoded batch of lora packets).
+    // The body is not copied, it has to stay untouched until
+    // uplink_poll reports that the request is done
+    esp_http_client_set_post_field(uplink->client, (const char *)body, length);
+
+    uplink->frames = frames;
+    uplink->attempt = 0;
+    uplink->reply.valid = false;
+
+    // Still waiting out the reconnect delay of an earlier failure
+    uplink->state = esp_timer_get_time() < uplink->retry_at_us ? UPLINK_STATE_BACKOFF : UPLINK_STATE_SENDING;
+    uplink->request_start_us = esp_timer_get_time();
+    if (uplink->state == UPLINK_STATE_SENDING) {
+        uplink->stats.requests++;
+        metrics_count(METRIC_UPLOAD_REQUESTS);
+    }
+
+    return ESP_OK;
+}
+
+esp_err_t uplink_start(uplink_client_t *uplink, const uint8_t *body, size_t length, int frames, const char *encoding) {
+    return uplink_start_request(uplink, uplink->data_url, body, length, frames, encoding);
+}
+
+esp_err_t uplink_start_heartbeat(uplink_client_t *uplink, const uint8_t *body, size_t length) {
+    return uplink_start_request(uplink, uplink->heartbeat_url, body, length, 0, NULL);
+}
+
+uplink_result_t uplink_poll(uplink_client_t *uplink) {
+    switch (uplink->state) {
+        case UPLINK_STATE_IDLE:
+            return UPLINK_RESULT_IDLE;
+
+        case UPLINK_STATE_BACKOFF:
+            if (esp_timer_get_time() < uplink->retry_at_us) {
+                return UPLINK_RESULT_IN_PROGRESS;
+            }
+
+            uplink->state = UPLINK_STATE_SENDING;
+            uplink->request_start_us = esp_timer_get_time();
+            uplink->stats.requests++;
+            metrics_count(METRIC_UPLOAD_REQUESTS);
+            // The first perform call follows right away
+            __attribute__((fallthrough));
+
+        case UPLINK_STATE_SENDING:
+            break;
+    }
+
+    // Performs one non-blocking step of the request.
+    // EAGAIN means the socket is not ready yet, the caller
+    // comes back after it waited for a while
+    esp_err_t err = esp_http_client_perform(uplink->client);
+    if (err == ESP_ERR_HTTP_EAGAIN) {
+        return UPLINK_RESULT_IN_PROGRESS;
+    }
+
+    // Only a 2xx response means the backend stored the body.
+    // Server errors, timeouts (408) and throttling (429) are
+    // retried like a broken connection, any other 4xx is final
+    int status = 0;
+    if (err == ESP_OK) {
+        status = esp_http_client_get_status_code(uplink->client);
+        metrics_count_http_status(status);
+    }
+
+    if (err == ESP_OK && status >= 200 && status < 300) {
+        trace_event(TRACE_UPLOAD_DONE, status, uplink->frames);
+        uplink_parse_reply(uplink);
+
+        metrics_add(METRIC_UPLOAD_FRAMES, uplink->frames);
+        metrics_record(METRIC_HIST_UPLOAD_MS, (esp_timer_get_time() - uplink->request_start_us) / 1000);
+
+        uplink->backoff_ms = CONFIG_UPLINK_BACKOFF_MIN_MS;
+        uplink->retry_at_us = 0;
+        uplink->state = UPLINK_STATE_IDLE;
+
+#if !CONFIG_UPLINK_PERSISTENT_CONNECTION
+        esp_http_client_close(uplink->client);
+#endif
+        return UPLINK_RESULT_DONE;
+    }
+
+    uplink->stats.failures++;
+    metrics_count(METRIC_UPLOAD_FAILURES);
+
+    if (err == ESP_OK && status >= 400 && status < 500 && status != 408 && status != 429) {
+        // The backend is reachable, only this request is refused
+        trace_event(TRACE_UPLOAD_REJECTED, uplink->attempt + 1, status);
+
+        uplink->backoff_ms = CONFIG_UPLINK_BACKOFF_MIN_MS;
+        uplink->retry_at_us = 0;
+        uplink->state = UPLINK_STATE_IDLE;
+
+#if !CONFIG_UPLINK_PERSISTENT_CONNECTION
+        esp_http_client_close(uplink->client);
+#endif
+        return UPLINK_RESULT_REJECTED;
+    }
+
+    if (err == ESP_OK) {
+        // The connection is still good after an error status
+        trace_event(TRACE_UPLOAD_REJECTED, uplink->attempt + 1, status);
+#if !CONFIG_UPLINK_PERSISTENT_CONNECTION
+        esp_http_client_close(uplink->client);
+#endif
+    } else {
+        // Drops the broken connection, the next attempt
+        // reconnects after an exponentially growing delay
+        trace_event(TRACE_UPLOAD_FAILED, uplink->attempt + 1, err);
+        uplink->stats.reconnects++;
+        esp_http_client_close(uplink->client);
+    }
+
+    uplink->retry_at_us = esp_timer_get_time() + (int64_t)uplink->backoff_ms * 1000;
+    uplink->backoff_ms = MIN(uplink->backoff_ms * 2, CONFIG_UPLINK_BACKOFF_MAX_MS);
+
+    if (++uplink->attempt >= CONFIG_UPLINK_MAX_ATTEMPTS) {
+        uplink->state = UPLINK_STATE_IDLE;
+        return UPLINK_RESULT_FAILED;
+    }
+
+    uplink->state = UPLINK_STATE_BACKOFF;
+    return UPLINK_RESULT_IN_PROGRESS;
+}
+
+bool uplink_busy(const uplink_client_t *uplink) {
+    return uplink->state != UPLINK_STATE_IDLE;
+}
+
+void uplink_get_stats(uplink_client_t *uplink, uplink_stats_t *stats) {
+    *stats = uplink->stats;
+}
@@ -0,0 +1,163 @@
+#include "uplink_batch.h"
+#include <string.h>
+#include <inttypes.h>
+#include "esp_log.h"
+#include "nvs.h"
+
+static const char *TAG = "UPLINK_BATCH";
+
+// Counts the boots in NVS, so the backend can tell the
+// receive times of spooled frames from earlier boots apart
+#define UPLINK_BATCH_NVS_NAMESPACE "uplink_batch"
+#define UPLINK_BATCH_NVS_BOOT "boot"
+
+// Boot counter written into every envelope (framing version 3)
+static uint32_t s_batch_boot;
+
+// Packets after which a batch counts as full, the buffers
+// always hold CONFIG_UPLINK_BATCH_MAX_PACKETS
+static uint8_t s_batch_max_packets = CONFIG_UPLINK_BATCH_MAX_PACKETS;
+
+// Counts this boot, runs after nvs_flash_init(). Without NVS the
+// frames carry boot 0, which the backend takes as unknown
+esp_err_t uplink_batch_init(void) {
+    nvs_handle_t handle;
+    uint32_t boot = 0;
+
+    esp_err_t err = nvs_open(UPLINK_BATCH_NVS_NAMESPACE, NVS_READWRITE, &handle);
+    if (err == ESP_OK) {
+        err = nvs_get_u32(handle, UPLINK_BATCH_NVS_BOOT, &boot);
+        if (err == ESP_OK || err == ESP_ERR_NVS_NOT_FOUND) {
+            // Skips 0 when the counter wraps
+            boot = boot + 1 > 0 ? boot + 1 : 1;
+            err = nvs_set_u32(handle, UPLINK_BATCH_NVS_BOOT, boot);
+        }
+        if (err == ESP_OK) {
+            err = nvs_commit(handle);
+        }
+        nvs_close(handle);
+    }
+
+    if (err != ESP_OK) {
+        ESP_LOGW(TAG, "Boot counter not available: %s", esp_err_to_name(err));
+        boot = 0;
+    }
+    s_batch_boot = boot;
+    ESP_LOGI(TAG, "Boot %" PRIu32, boot);
+
+    return ESP_OK;
+}
+
+// Size of the metadata envelope in front of every payload
+size_t uplink_batch_envelope_size(uint8_t framing) {
+    if (framing >= 3) {
+        return UPLINK_BATCH_ENVELOPE_SIZE;
+    }
+    return framing == 2 ? UPLINK_BATCH_ENVELOPE_V2_SIZE : 0;
+}
+
+void uplink_batch_reset(uplink_batch_t *batch) {
+    batch->body[0] = CONFIG_UPLINK_BATCH_FRAMING_VERSION;
+    batch->body[1] = 0;
+    batch->length = UPLINK_BATCH_HEADER_SIZE;
+    batch->count = 0;
+}
+
+// Writes the radio metadata of a packet in front of its payload
+static void uplink_batch_write_envelope(uint8_t *out, size_t envelope, const lora_packet_t *packet) {
+    int16_t rssi = packet->meta.rssi;
+    int32_t freq_error = packet->meta.freq_error;
+    uint32_t rx_time_ms = (uint32_t)(packet->rx_timestamp / 1000);
+
+    out[0] = (uint8_t)(rssi & 0xff);
+    out[1] = (uint8_t)((rssi >> 8) & 0xff);
+    out[2] = (uint8_t)packet->meta.snr;
+    out[3] = (uint8_t)(freq_error & 0xff);
+    out[4] = (uint8_t)((freq_error >> 8) & 0xff);
+    out[5] = (uint8_t)((freq_error >> 16) & 0xff);
+    out[6] = (uint8_t)(rx_time_ms & 0xff);
+    out[7] = (uint8_t)((rx_time_ms >> 8) & 0xff);
+    out[8] = (uint8_t)((rx_time_ms >> 16) & 0xff);
+    out[9] = (uint8_t)(rx_time_ms >> 24);
+
+    if (envelope >= UPLINK_BATCH_ENVELOPE_SIZE) {
+        out[10] = (uint8_t)(s_batch_boot & 0xff);
+        out[11] = (uint8_t)((s_batch_boot >> 8) & 0xff);
+        out[12] = (uint8_t)((s_batch_boot >> 16) & 0xff);
+        out[13] = (uint8_t)(s_batch_boot >> 24);
+    }
+}
+
+bool uplink_batch_add(uplink_batch_t *batch, const lora_packet_t *packet) {
+    size_t envelope = uplink_batch_envelope_size(batch->body[0]);
+    size_t size = envelope + packet->payload_size;
+
+    if (uplink_batch_full(batch) || packet->payload_size > LORA_MAX_PACKET_SIZE) {
+        return false;
+    }
+
+    // Length prefix, metadata envelope and the payload,
+    // written in place so the packet is copied only once
+    uint8_t *out = batch->body + batch->length;
+    out[0] = (uint8_t)(size & 0xff);
+    out[1] = (uint8_t)(size >> 8);
+    if (envelope > 0) {
+        uplink_batch_write_envelope(out + UPLINK_BATCH_FRAME_HEADER_SIZE, envelope, packet);
+    }
+    memcpy(out + UPLINK_BATCH_FRAME_HEADER_SIZE + envelope, packet->payload, packet->payload_size);
+
+    batch->length += UPLINK_BATCH_FRAME_HEADER_SIZE + size;
+    batch->count++;
+    batch->body[1] = batch->count;
+
+    return true;
+}
+
+bool uplink_batch_add_frame(uplink_batch_t *batch, const uint8_t *frame, size_t size) {
+    if (uplink_batch_full(batch) || size > UPLINK_BATCH_FRAME_MAX_SIZE) {
+        return false;
+    }
+
+    // Length prefix followed by the encoded frame
+    uint8_t *out = batch->body + batch->length;
+    out[0] = (uint8_t)(size & 0xff);
+    out[1] = (uint8_t)(size >> 8);
+    memcpy(out + UPLINK_BATCH_FRAME_HEADER_SIZE, frame, size);
+
+    batch->length += UPLINK_BATCH_FRAME_HEADER_SIZE + size;
+    batch->count++;
+    batch->body[1] = batch->count;
+
+    return true;
+}
+
+bool uplink_batch_next_frame(const uplink_batch_t *batch, size_t *offset, const uint8_t **frame, size_t *size) {
+    // Starts right after the batch header
+    if (*offset < UPLINK_BATCH_HEADER_SIZE) {
+        *offset = UPLINK_BATCH_HEADER_SIZE;
+    }
+
+    if (*offset + UPLINK_BATCH_FRAME_HEADER_SIZE > batch->length) {
+        return false;
+    }
+
+    const uint8_t *in = batch->body + *offset;
+    *size = in[0] | (in[1] << 8);
+    *frame = in + UPLINK_BATCH_FRAME_HEADER_SIZE;
+    *offset += UPLINK_BATCH_FRAME_HEADER_SIZE + *size;
+
+    return *offset <= batch->length;
+}
+
+bool uplink_batch_full(const uplink_batch_t *batch) {
+    return batch->count >= __atomic_load_n(&s_batch_max_packets, __ATOMIC_RELAXED);
+}
+
+// Lowers the packets per batch at runtime, 0 restores
+// the firmware setting. Batches already fuller are sent as they are
+void uplink_batch_set_limit(uint8_t max_packets) {
+    if (max_packets == 0 || max_packets > CONFIG_UPLINK_BATCH_MAX_PACKETS) {
+        max_packets = CONFIG_UPLINK_BATCH_MAX_PACKETS;
+    }
+    __atomic_store_n(&s_batch_max_packets, max_packets, __ATOMIC_RELAXED);
+}
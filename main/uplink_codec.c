@@ -0,0 +1,282 @@
+#include <string.h>
+#include <sys/param.h>
+#include "esp_timer.h"
+#include "metrics.h"
+#include "uplink_codec.h"
+
+// Most frames a batch can hold, the upper bound of UPLINK_BATCH_MAX_PACKETS
+#define UPLINK_CODEC_MAX_FRAMES 64
+
+// lz4 block format limits: a match is at least 4 bytes, the
+// last match starts 12 bytes before the end of the input and
+// the last 5 bytes are always literals
+#define UPLINK_CODEC_MIN_MATCH 4
+#define UPLINK_CODEC_MF_LIMIT 12
+#define UPLINK_CODEC_LAST_LITERALS 5
+
+// Positions in the hash table are 16 bit
+_Static_assert(UPLINK_BATCH_BUFFER_SIZE <= UINT16_MAX, "batch too large for the codec");
+
+// XORs the payload of every frame with the latest earlier frame
+// of the same node. The offsets of the frames in out match the
+// reference. Encoding passes the original batch as reference,
+// decoding passes the decoded batch as both, as the earlier
+// frames are already restored when a later one needs them
+static bool uplink_codec_delta(const uplink_batch_t *reference, uint8_t *out) {
+    size_t envelope = uplink_batch_envelope_size(reference->body[0]);
+    uint16_t payloads[UPLINK_CODEC_MAX_FRAMES];
+    uint16_t sizes[UPLINK_CODEC_MAX_FRAMES];
+    int frames = 0;
+
+    const uint8_t *frame;
+    size_t offset = 0;
+    size_t size;
+
+    while (uplink_batch_next_frame(reference, &offset, &frame, &size)) {
+        if (frames == UPLINK_CODEC_MAX_FRAMES) {
+            return false;
+        }
+
+        // Frames too short for a node id are neither coded nor referenced
+        if (size < envelope + sizeof(uint32_t)) {
+            sizes[frames++] = 0;
+            continue;
+        }
+
+        size_t payload = frame - reference->body + envelope;
+        size_t payload_size = size - envelope;
+
+        for (int j = frames - 1; j >= 0; j--) {
+            if (sizes[j] > 0 && memcmp(reference->body + payloads[j], reference->body + payload, sizeof(uint32_t)) == 0) {
+                size_t common = MIN(payload_size, sizes[j]);
+                for (size_t k = sizeof(uint32_t); k < common; k++) {
+                    out[payload + k] ^= reference->body[payloads[j] + k];
+                }
+                break;
+            }
+        }
+
+        payloads[frames] = payload;
+        sizes[frames] = payload_size;
+        frames++;
+    }
+
+    return true;
+}
+
+static inline uint32_t uplink_codec_read32(const uint8_t *in) {
+    uint32_t value;
+    memcpy(&value, in, sizeof(value));
+    return value;
+}
+
+static inline uint32_t uplink_codec_hash(uint32_t sequence) {
+    return (sequence * 2654435761u) >> (32 - UPLINK_CODEC_HASH_BITS);
+}
+
+// Writes a length which did not fit into its 4 bit token field
+static uint8_t *uplink_codec_put_length(uint8_t *out, size_t length) {
+    while (length >= 255) {
+        *out++ = 255;
+        length -= 255;
+    }
+    *out++ = (uint8_t)length;
+    return out;
+}
+
+// Writes one lz4 sequence: the literals since the last match
+// followed by a match, or the final literals when length is 0.
+// Returns NULL when it does not fit into the output
+static uint8_t *uplink_codec_put_sequence(uint8_t *out, const uint8_t *end, const uint8_t *literals, size_t literal_length,
+                                          uint16_t match_offset, size_t match_length) {
+    // Token, both length extensions, the literals and the offset
+    if (out + 1 + literal_length / 255 + 1 + literal_length + 2 + match_length / 255 + 1 > end) {
+        return NULL;
+    }
+
+    uint8_t *token = out++;
+    if (literal_length >= 15) {
+        *token = 15 << 4;
+        out = uplink_codec_put_length(out, literal_length - 15);
+    } else {
+        *token = literal_length << 4;
+    }
+
+    memcpy(out, literals, literal_length);
+    out += literal_length;
+
+    if (match_length == 0) {
+        return out;
+    }
+
+    *out++ = (uint8_t)(match_offset & 0xff);
+    *out++ = (uint8_t)(match_offset >> 8);
+
+    match_length -= UPLINK_CODEC_MIN_MATCH;
+    if (match_length >= 15) {
+        *token |= 15;
+        out = uplink_codec_put_length(out, match_length - 15);
+    } else {
+        *token |= match_length;
+    }
+
+    return out;
+}
+
+// Greedy lz4 block compressor with a single hash table probe per
+// position. Returns the compressed size, or 0 when it would not
+// fit into size bytes
+static size_t uplink_codec_compress(uint16_t *table, const uint8_t *in, size_t length, uint8_t *out, size_t size) {
+    const uint8_t *end = out + size;
+    uint8_t *op = out;
+    size_t anchor = 0;
+    size_t ip = 0;
+
+    memset(table, 0, sizeof(uint16_t) << UPLINK_CODEC_HASH_BITS);
+
+    if (length > UPLINK_CODEC_MF_LIMIT) {
+        size_t match_start_limit = length - UPLINK_CODEC_MF_LIMIT;
+        size_t match_end_limit = length - UPLINK_CODEC_LAST_LITERALS;
+
+        while (ip < match_start_limit) {
+            uint32_t sequence = uplink_codec_read32(in + ip);
+            uint32_t h = uplink_codec_hash(sequence);
+            size_t ref = table[h];
+            table[h] = ip;
+
+            if (ref >= ip || uplink_codec_read32(in + ref) != sequence) {
+                ip++;
+                continue;
+            }
+
+            size_t match_length = UPLINK_CODEC_MIN_MATCH;
+            while (ip + match_length < match_end_limit && in[ref + match_length] == in[ip + match_length]) {
+                match_length++;
+            }
+
+            op = uplink_codec_put_sequence(op, end, in + anchor, ip - anchor, ip - ref, match_length);
+            if (op == NULL) {
+                return 0;
+            }
+
+            ip += match_length;
+            anchor = ip;
+        }
+    }
+
+    op = uplink_codec_put_sequence(op, end, in + anchor, length - anchor, 0, 0);
+    return op == NULL ? 0 : op - out;
+}
+
+// Reads a length which continues past its 4 bit token field
+static bool uplink_codec_get_length(const uint8_t **in, const uint8_t *end, size_t *length) {
+    uint8_t byte;
+    do {
+        if (*in >= end) {
+            return false;
+        }
+        byte = *(*in)++;
+        *length += byte;
+    } while (byte == 255);
+    return true;
+}
+
+// lz4 block decompressor, checks every read and write against the bounds.
+// Returns the decompressed size or 0 on a malformed block
+static size_t uplink_codec_decompress(const uint8_t *in, size_t length, uint8_t *out, size_t size) {
+    const uint8_t *end = in + length;
+    size_t op = 0;
+
+    while (in < end) {
+        uint8_t token = *in++;
+
+        size_t literal_length = token >> 4;
+        if (literal_length == 15 && !uplink_codec_get_length(&in, end, &literal_length)) {
+            return 0;
+        }
+        if (literal_length > (size_t)(end - in) || literal_length > size - op) {
+            return 0;
+        }
+        memcpy(out + op, in, literal_length);
+        in += literal_length;
+        op += literal_length;
+
+        // The last sequence ends after its literals
+        if (in == end) {
+            break;
+        }
+
+        if (end - in < 2) {
+            return 0;
+        }
+        size_t match_offset = in[0] | (in[1] << 8);
+        in += 2;
+
+        size_t match_length = token & 15;
+        if (match_length == 15 && !uplink_codec_get_length(&in, end, &match_length)) {
+            return 0;
+        }
+        match_length += UPLINK_CODEC_MIN_MATCH;
+
+        if (match_offset == 0 || match_offset > op || match_length > size - op) {
+            return 0;
+        }
+
+        // Byte by byte, a match may overlap the bytes it produces
+        for (size_t i = 0; i < match_length; i++, op++) {
+            out[op] = out[op - match_offset];
+        }
+    }
+
+    return op;
+}
+
+bool uplink_codec_encode(uplink_codec_t *codec, const uplink_batch_t *batch) {
+    int64_t start = esp_timer_get_time();
+    bool smaller = false;
+
+    memcpy(codec->scratch, batch->body, batch->length);
+
+    if (uplink_codec_delta(batch, codec->scratch)) {
+        size_t compressed = uplink_codec_compress(codec->table, codec->scratch, batch->length,
+                                                  codec->encoded + UPLINK_CODEC_HEADER_SIZE,
+                                                  batch->length - MIN(batch->length, UPLINK_CODEC_HEADER_SIZE + 1));
+        if (compressed > 0) {
+            codec->encoded[0] = UPLINK_CODEC_VERSION;
+            codec->encoded[1] = (uint8_t)(batch->length & 0xff);
+            codec->encoded[2] = (uint8_t)(batch->length >> 8);
+            codec->length = UPLINK_CODEC_HEADER_SIZE + compressed;
+            smaller = true;
+        }
+    }
+
+    // Batches which did not shrink are sent as they are,
+    // the output counter holds what actually went out
+    metrics_add(METRIC_CODEC_BYTES_IN, batch->length);
+    metrics_add(METRIC_CODEC_BYTES_OUT, smaller ? codec->length : batch->length);
+    metrics_add(METRIC_CODEC_TIME_US, esp_timer_get_time() - start);
+
+    return smaller;
+}
+
+bool uplink_codec_decode(const uint8_t *body, size_t length, uplink_batch_t *batch) {
+    if (length < UPLINK_CODEC_HEADER_SIZE || body[0] != UPLINK_CODEC_VERSION) {
+        return false;
+    }
+
+    size_t expected = body[1] | (body[2] << 8);
+    if (expected < UPLINK_BATCH_HEADER_SIZE || expected > sizeof(batch->body)) {
+        return false;
+    }
+
+    size_t decoded = uplink_codec_decompress(body + UPLINK_CODEC_HEADER_SIZE, length - UPLINK_CODEC_HEADER_SIZE,
+                                             batch->body, sizeof(batch->body));
+    if (decoded != expected) {
+        return false;
+    }
+
+    batch->length = decoded;
+    batch->count = batch->body[1];
+
+    return uplink_codec_delta(batch, batch->body);
+}